@@ -1,43 +1,175 @@
 #include <iostream>
 #include <stdexcept>
 #include "generator.h"
+#include "metrics.h"
+#include "blockRing.h"
+#include "outputEncoder.h"
 #include <optional>
 #include <cstring>
 #include <string>
+#include <thread>
+#include <vector>
+#include <exception>
 
 #define MIN(A, B) A > B ? B : A
+#define OUTPUT_BLOCK_SIZE (64 * 1024)
 
-const static char *usage = "usage: ./RBG password confusionString iterationCount [--limit nbytes] [--patternBytes nbytes]";
+const static char *usage = "usage: ./RBG password confusionString iterationCount [--limit nbytes] [--patternBytes nbytes] [--metrics-file path] [--pipeline depth] [--threads n] [--format raw|hex|base64|base64url] [--stream-id label] [--checkpoint path] [--checkpoint-interval seconds]";
 
 struct OptionalArguments
 {
     std::optional<int> limit;
     std::optional<int> patternBytes;
+    std::optional<std::string> metricsFile;
+    std::optional<int> pipelineDepth;
+    std::optional<int> threads;
+    std::optional<OutputFormat> format;
+    std::optional<std::string> streamId;
+    std::optional<std::string> checkpointFile;
+    std::optional<int> checkpointInterval;
 };
 
 
-void produceDataUntilLimit(Generator &generator, std::optional<int> limit)
+// Encoded formats are produced in the output stage, so the limit and the
+// metrics count encoded bytes; encoding is timed apart from the write.
+// Output goes OUTPUT_BLOCK_SIZE bytes at a time, so the metrics cost a few
+// clock reads per block rather than per KiB.
+void produceDataUntilLimit(Generator &generator, std::optional<int> limit, Metrics &metrics, OutputFormat format)
 {
-    uint8_t block[1024];
-    int bytesWritten = 0, bytesToWrite = 0, missingBytes = 0;
+    std::vector<uint8_t> block(OUTPUT_BLOCK_SIZE);
+    OutputEncoder encoder(format);
+    std::vector<uint8_t> encoded(format != OutputFormat::RAW ? encoder.maxEncodedLength(OUTPUT_BLOCK_SIZE) : 0);
+    const uint8_t *output = block.data();
+    int bytesWritten = 0, bytesToWrite = 0, missingBytes = 0, bytesProduced = OUTPUT_BLOCK_SIZE;
 
     while (!limit.has_value() || bytesWritten < limit.value())
     {
-        generator.nextBlock(block, sizeof(block));
+        Metrics::Clock::time_point start = Metrics::Clock::now();
+        generator.nextBlock(block.data(), OUTPUT_BLOCK_SIZE);
+        metrics.recordGenerate(Metrics::Clock::now() - start);
+
+        if (format != OutputFormat::RAW)
+        {
+            start = Metrics::Clock::now();
+            bytesProduced = encoder.encode(block.data(), OUTPUT_BLOCK_SIZE, encoded.data());
+            metrics.recordEncode(Metrics::Clock::now() - start);
+            output = encoded.data();
+        }
 
         if (!limit.has_value())
         {
-            bytesToWrite = sizeof(block);
+            bytesToWrite = bytesProduced;
         }
         else
         {
             missingBytes = limit.value() - bytesWritten;
-            bytesToWrite = MIN((int)sizeof(block), missingBytes);
+            bytesToWrite = MIN(bytesProduced, missingBytes);
+        }
+
+        metrics.beginWrite();
+        fwrite(output, sizeof(uint8_t), bytesToWrite, stdout);
+        metrics.endWrite(bytesToWrite);
+        bytesWritten += bytesToWrite;
+    }
+
+    metrics.beginWrite();
+    fflush(stdout);
+    metrics.endWrite(0);
+    metrics.finish();
+}
+
+
+// Generator thread: keeps the ring full until the consumer closes it
+void fillBlockRing(Generator &generator, BlockRing &ring, std::exception_ptr &error)
+{
+    try
+    {
+        BlockRing::Slot *slot;
+
+        while ((slot = ring.acquireFree()) != nullptr)
+        {
+            Metrics::Clock::time_point start = Metrics::Clock::now();
+            generator.nextBlock(slot->data, slot->length);
+            slot->generateTime = Metrics::Clock::now() - start;
+
+            ring.publish();
+        }
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+        ring.close();
+    }
+}
+
+// Closes the ring and joins the producer on every exit path; a consumer
+// exception must not destroy a joinable std::thread (std::terminate), and
+// the producer only returns once the ring is closed
+struct ProducerGuard
+{
+    BlockRing &ring;
+    std::thread &producer;
+
+    void stop()
+    {
+        ring.close();
+        if (producer.joinable())
+            producer.join();
+    }
+
+    ~ProducerGuard() { stop(); }
+};
+
+// Same output as produceDataUntilLimit, but generation runs on its own thread
+// and overlaps with the writes done here
+void producePipelinedDataUntilLimit(Generator &generator, std::optional<int> limit, Metrics &metrics, int depth, OutputFormat format)
+{
+    BlockRing ring(depth, PIPELINE_BUFFER_SIZE);
+    OutputEncoder encoder(format);
+    std::vector<uint8_t> encoded(format != OutputFormat::RAW ? encoder.maxEncodedLength(PIPELINE_BUFFER_SIZE) : 0);
+    std::exception_ptr error;
+    std::thread producer(fillBlockRing, std::ref(generator), std::ref(ring), std::ref(error));
+    ProducerGuard guard{ring, producer};
+
+    long long bytesWritten = 0;
+    int bytesToWrite = 0;
+    const uint8_t *output;
+    BlockRing::Slot *slot;
+
+    while ((!limit.has_value() || bytesWritten < limit.value()) && (slot = ring.acquireFilled()) != nullptr)
+    {
+        metrics.recordGenerate(slot->generateTime);
+
+        output = slot->data;
+        bytesToWrite = slot->length;
+        if (format != OutputFormat::RAW)
+        {
+            Metrics::Clock::time_point start = Metrics::Clock::now();
+            bytesToWrite = encoder.encode(slot->data, slot->length, encoded.data());
+            metrics.recordEncode(Metrics::Clock::now() - start);
+            output = encoded.data();
         }
 
-        fwrite(block, sizeof(uint8_t), bytesToWrite, stdout);
+        if (limit.has_value())
+            bytesToWrite = MIN(bytesToWrite, (int)(limit.value() - bytesWritten));
+
+        metrics.beginWrite();
+        fwrite(output, sizeof(uint8_t), bytesToWrite, stdout);
+        metrics.endWrite(bytesToWrite);
+
+        ring.release();
         bytesWritten += bytesToWrite;
     }
+
+    guard.stop();
+
+    if (error)
+        std::rethrow_exception(error);
+
+    metrics.beginWrite();
+    fflush(stdout);
+    metrics.endWrite(0);
+    metrics.finish();
 }
 
 
@@ -72,12 +204,77 @@ void parseArgs(int argc, char *argv[], GeneratorArgs &args, OptionalArguments &o
             if (i + 1 >= argc)
                 throw std::invalid_argument("Missing argument for --patternBytes");
 
-            if (std::stoi(argv[i + 1]) < 1)
+            if (std::stoi(argv[i + 1]) < 1 || std::stoi(argv[i + 1]) > MAX_PATTERN_BYTES)
                 throw std::invalid_argument("Invalid patternBytes value");
             
             optionalArgs.patternBytes = std::stoi(argv[i + 1]);
             i++;
         }
+        else if (strcmp(argv[i], "--metrics-file") == 0)
+        {
+            if (i + 1 >= argc)
+                throw std::invalid_argument("Missing argument for --metrics-file");
+
+            optionalArgs.metricsFile = argv[i + 1];
+            i++;
+        }
+        else if (strcmp(argv[i], "--pipeline") == 0)
+        {
+            if (i + 1 >= argc)
+                throw std::invalid_argument("Missing argument for --pipeline");
+
+            if (std::stoi(argv[i + 1]) < PIPELINE_MIN_DEPTH)
+                throw std::invalid_argument("Invalid pipeline depth value");
+
+            optionalArgs.pipelineDepth = std::stoi(argv[i + 1]);
+            i++;
+        }
+        else if (strcmp(argv[i], "--threads") == 0)
+        {
+            if (i + 1 >= argc)
+                throw std::invalid_argument("Missing argument for --threads");
+
+            if (std::stoi(argv[i + 1]) < 1)
+                throw std::invalid_argument("Invalid threads value");
+
+            optionalArgs.threads = std::stoi(argv[i + 1]);
+            i++;
+        }
+        else if (strcmp(argv[i], "--format") == 0)
+        {
+            if (i + 1 >= argc)
+                throw std::invalid_argument("Missing argument for --format");
+
+            optionalArgs.format = OutputEncoder::parseFormat(argv[i + 1]);
+            i++;
+        }
+        else if (strcmp(argv[i], "--stream-id") == 0)
+        {
+            if (i + 1 >= argc)
+                throw std::invalid_argument("Missing argument for --stream-id");
+
+            optionalArgs.streamId = argv[i + 1];
+            i++;
+        }
+        else if (strcmp(argv[i], "--checkpoint") == 0)
+        {
+            if (i + 1 >= argc)
+                throw std::invalid_argument("Missing argument for --checkpoint");
+
+            optionalArgs.checkpointFile = argv[i + 1];
+            i++;
+        }
+        else if (strcmp(argv[i], "--checkpoint-interval") == 0)
+        {
+            if (i + 1 >= argc)
+                throw std::invalid_argument("Missing argument for --checkpoint-interval");
+
+            if (std::stoi(argv[i + 1]) < 1)
+                throw std::invalid_argument("Invalid checkpoint interval value");
+
+            optionalArgs.checkpointInterval = std::stoi(argv[i + 1]);
+            i++;
+        }
         else
         {
             throw std::invalid_argument("Invalid argument");
@@ -89,6 +286,9 @@ void parseArgs(int argc, char *argv[], GeneratorArgs &args, OptionalArguments &o
     } else {
         args.patternBytes = PatternBytes;
     }
+
+    if (optionalArgs.threads.has_value())
+        args.threads = optionalArgs.threads.value();
 }
 
 
@@ -110,11 +310,24 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    
+    // before any thread starts, so SIGUSR1 only reaches the metrics reporter
+    Metrics::blockSnapshotSignal();
+    Metrics metrics(optionalArgs.metricsFile);
 
-    Generator generator = Generator(args);
+    Generator generator(args);
+    if (optionalArgs.checkpointFile.has_value())
+        generator.setCheckpointFile(optionalArgs.checkpointFile.value(),
+                                    std::chrono::seconds(optionalArgs.checkpointInterval.value_or(CHECKPOINT_INTERVAL_SECONDS)));
     generator.setup();
 
-    produceDataUntilLimit(generator, optionalArgs.limit);
+    if (optionalArgs.streamId.has_value())
+        generator = generator.substream(optionalArgs.streamId.value());
+
+    metrics.startOutput();
+    OutputFormat format = optionalArgs.format.value_or(OutputFormat::RAW);
+    if (optionalArgs.pipelineDepth.has_value())
+        producePipelinedDataUntilLimit(generator, optionalArgs.limit, metrics, optionalArgs.pipelineDepth.value(), format);
+    else
+        produceDataUntilLimit(generator, optionalArgs.limit, metrics, format);
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,112 @@
+#include "argon2Arena.h"
+#include "generatorException.h"
+#include <sys/mman.h>
+#include <sodium.h>
+#include <cstring>
+
+thread_local Argon2Arena *Argon2Arena::current = nullptr;
+
+Argon2Arena::~Argon2Arena()
+{
+    unmap();
+}
+
+// Every hash call leaves the memory wiped, so it is unmapped as is
+void Argon2Arena::unmap()
+{
+    if (this->memory != nullptr)
+        munmap(this->memory, this->size);
+
+    this->memory = nullptr;
+    this->size = 0;
+    this->hugePages = false;
+}
+
+void Argon2Arena::reserve(size_t nbytes)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    if (nbytes <= this->size)
+        return;
+
+    unmap();
+
+    size_t rounded = (nbytes + ARGON2_ARENA_HUGE_PAGE_SIZE - 1) / ARGON2_ARENA_HUGE_PAGE_SIZE * ARGON2_ARENA_HUGE_PAGE_SIZE;
+
+    // explicit huge pages only work when the administrator reserved them
+    void *mapped = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    this->hugePages = mapped != MAP_FAILED;
+
+    if (mapped == MAP_FAILED)
+    {
+        mapped = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED)
+            throw GeneratorException("Unable to map Argon2 arena memory", GeneratorExceptionTypes::GENERATOR_SETUP_ERROR);
+
+#ifdef MADV_HUGEPAGE
+        this->hugePages = madvise(mapped, rounded, MADV_HUGEPAGE) == 0;
+#endif
+        // touching every byte after madvise faults the region in as huge
+        // pages where the kernel allows it
+        memset(mapped, 0, rounded);
+    }
+
+    this->memory = static_cast<uint8_t *>(mapped);
+    this->size = rounded;
+}
+
+int Argon2Arena::hash(argon2_context &context, argon2_type type)
+{
+    size_t needed = (size_t)context.m_cost * ARGON2_BLOCK_SIZE;
+
+    try
+    {
+        reserve(needed);
+    }
+    catch (GeneratorException &exception)
+    {
+        return ARGON2_MEMORY_ALLOCATION_ERROR;
+    }
+
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    context.allocate_cbk = Argon2Arena::allocate;
+    context.free_cbk = Argon2Arena::release;
+
+    Argon2Arena::current = this;
+    int status = argon2_ctx(&context, type);
+    Argon2Arena::current = nullptr;
+
+    // argon2_ctx returns without freeing the memory when filling it fails
+    if (this->inUse)
+    {
+        sodium_memzero(this->memory, needed);
+        this->inUse = false;
+    }
+
+    return status;
+}
+
+int Argon2Arena::allocate(uint8_t **memory, size_t nbytes)
+{
+    Argon2Arena *arena = Argon2Arena::current;
+
+    if (arena == nullptr || arena->inUse || nbytes > arena->size)
+        return ARGON2_MEMORY_ALLOCATION_ERROR;
+
+    arena->inUse = true;
+    *memory = arena->memory;
+    return ARGON2_OK;
+}
+
+// libargon2 wipes the memory itself (clear_internal_memory) right before
+// calling this, so the arena only takes it back
+void Argon2Arena::release(uint8_t *memory, size_t nbytes)
+{
+    Argon2Arena *arena = Argon2Arena::current;
+
+    if (arena == nullptr || memory != arena->memory)
+        return;
+
+    arena->inUse = false;
+}
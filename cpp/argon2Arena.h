@@ -0,0 +1,52 @@
+#pragma once
+
+#include <argon2.h>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#define ARGON2_ARENA_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Persistent memory for Argon2, handed to libargon2 through its
+// allocate_cbk/free_cbk hooks. The mapping is made once, backed by huge pages
+// when possible (MAP_HUGETLB, else transparent huge pages via madvise) and
+// prefaulted, so repeated setups in one process skip the allocation and page
+// faults of a fresh 1 GiB region. libargon2 wipes the memory before handing
+// it back after every use (the arena only does it when a hash call fails
+// without freeing). Concurrent users are serialized.
+class Argon2Arena
+{
+
+public:
+    Argon2Arena() = default;
+    ~Argon2Arena();
+
+    Argon2Arena(const Argon2Arena &) = delete;
+    Argon2Arena &operator=(const Argon2Arena &) = delete;
+
+    // Maps and prefaults at least nbytes up front; otherwise the first hash
+    // call does it
+    void reserve(size_t nbytes);
+
+    // argon2_ctx with the arena as the context's allocator
+    int hash(argon2_context &context, argon2_type type);
+
+    bool usesHugePages() const { return this->hugePages; }
+    size_t capacity() const { return this->size; }
+
+protected:
+    void unmap();
+
+    static int allocate(uint8_t **memory, size_t nbytes);
+    static void release(uint8_t *memory, size_t nbytes);
+
+    uint8_t *memory = nullptr;
+    size_t size = 0;
+    bool hugePages = false;
+    bool inUse = false;
+    std::mutex lock;
+
+    // the libargon2 hooks take no user data, so the arena serving the
+    // current thread's hash call is found through this
+    static thread_local Argon2Arena *current;
+};
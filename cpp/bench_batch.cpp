@@ -0,0 +1,116 @@
+#include "generatorBatch.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Compares GeneratorBatch against the same generators run one by one, for
+// the pattern search of the setup and for bulk output. Argon2 runs the same
+// way in both, so it is left out: both searches start from fixed bootstrap
+// seeds.
+
+// usage: ./bench_batch [generators] [iterationCount] [patternBytes]
+
+using Clock = std::chrono::steady_clock;
+
+class BenchGenerator : public Generator
+{
+public:
+    using Generator::findNextSeedByPattern;
+    using Generator::generatePattern;
+    using Generator::initializeGenerator;
+    using Generator::Pattern;
+    using Generator::Seed;
+    using Generator::setupDone;
+
+    BenchGenerator(GeneratorArgs args) : Generator(args) {}
+};
+
+class BenchBatch : public GeneratorBatch
+{
+public:
+    using GeneratorBatch::searchSeeds;
+
+    BenchBatch(std::vector<Generator> &generators) : GeneratorBatch(generators) { this->lockstep = true; }
+};
+
+static double seconds(Clock::duration d)
+{
+    return std::chrono::duration<double>(d).count();
+}
+
+int main(int argc, char *argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : GeneratorBatch::lanes();
+    int IC = argc > 2 ? atoi(argv[2]) : 400;
+    int patternBytes = argc > 3 ? atoi(argv[3]) : PatternBytes;
+    const int blockLength = 1 << 20, rounds = 32;
+
+    std::vector<GeneratorArgs> args(count);
+    std::vector<BenchGenerator::Seed> seeds(count);
+
+    for (int i = 0; i < count; i++)
+    {
+        args[i] = {"PW", "CS" + std::to_string(i), (uint16_t)IC, patternBytes};
+        memset(seeds[i].bytes, 0, sizeof(seeds[i].bytes));
+        seeds[i].bytes[0] = i;
+    }
+
+    // one by one, as Generator::setup after the bootstrap seed
+    std::vector<Generator> alone;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < count; i++)
+    {
+        BenchGenerator generator(args[i]);
+        BenchGenerator::Seed seed = seeds[i];
+        BenchGenerator::Pattern pattern;
+        pattern.size = patternBytes;
+        BenchGenerator::generatePattern(pattern, args[i].CS);
+
+        generator.initializeGenerator(seed);
+        for (int j = 0; j < IC; j++)
+        {
+            generator.findNextSeedByPattern(pattern, seed);
+            generator.initializeGenerator(seed);
+        }
+        generator.setupDone = true;
+        alone.push_back(std::move(generator));
+    }
+    double aloneSearch = seconds(Clock::now() - start);
+
+    std::vector<Generator> batched;
+    for (int i = 0; i < count; i++)
+        batched.emplace_back(args[i]);
+
+    BenchBatch batch(batched);
+    start = Clock::now();
+    batch.searchSeeds(seeds);
+    double batchSearch = seconds(Clock::now() - start);
+
+    std::vector<std::vector<uint8_t>> buffers(count, std::vector<uint8_t>(blockLength));
+    std::vector<uint8_t *> blocks;
+    for (auto &buffer : buffers)
+        blocks.push_back(buffer.data());
+
+    start = Clock::now();
+    for (int r = 0; r < rounds; r++)
+        for (int i = 0; i < count; i++)
+            alone[i].nextBlock(blocks[i], blockLength);
+    double aloneOutput = seconds(Clock::now() - start);
+
+    start = Clock::now();
+    for (int r = 0; r < rounds; r++)
+        batch.nextBlocks(blocks.data(), blockLength);
+    double batchOutput = seconds(Clock::now() - start);
+
+    double bytes = (double)count * blockLength * rounds;
+
+    printf("%d generators, IC %d, %d pattern bytes, %d lanes\n", count, IC, patternBytes, GeneratorBatch::lanes());
+    printf("search  alone %.3f s   batch %.3f s   speedup %.2fx\n", aloneSearch, batchSearch, aloneSearch / batchSearch);
+    printf("output  alone %.2f GB/s   batch %.2f GB/s   speedup %.2fx\n",
+           bytes / aloneOutput / 1e9, bytes / batchOutput / 1e9, aloneOutput / batchOutput);
+
+    return EXIT_SUCCESS;
+}
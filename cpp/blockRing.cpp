@@ -0,0 +1,90 @@
+#include "blockRing.h"
+#include <cstdlib>
+#include <new>
+
+BlockRing::BlockRing(int depth, int bufferSize)
+{
+    this->depth = depth;
+
+    // aligned_alloc requires the size to be a multiple of the alignment
+    size_t allocSize = (bufferSize + PIPELINE_BUFFER_ALIGNMENT - 1) / PIPELINE_BUFFER_ALIGNMENT * PIPELINE_BUFFER_ALIGNMENT;
+
+    for (int i = 0; i < depth; i++)
+    {
+        uint8_t *data = static_cast<uint8_t *>(std::aligned_alloc(PIPELINE_BUFFER_ALIGNMENT, allocSize));
+        if (data == nullptr)
+        {
+            for (Slot &slot : this->slots)
+                std::free(slot.data);
+            throw std::bad_alloc();
+        }
+
+        this->slots.push_back({data, bufferSize, Metrics::Clock::duration::zero()});
+    }
+}
+
+BlockRing::~BlockRing()
+{
+    for (Slot &slot : this->slots)
+        std::free(slot.data);
+}
+
+BlockRing::Slot *BlockRing::acquireFree()
+{
+    uint64_t h = this->head.load(std::memory_order_relaxed);
+
+    for (;;)
+    {
+        uint64_t t = this->tail.load(std::memory_order_acquire);
+
+        if (this->closed.load(std::memory_order_acquire))
+            return nullptr;
+
+        if (h - t < this->depth)
+            return &this->slots[h % this->depth];
+
+        this->tail.wait(t, std::memory_order_acquire);
+    }
+}
+
+void BlockRing::publish()
+{
+    this->head.fetch_add(1, std::memory_order_release);
+    this->head.notify_one();
+}
+
+BlockRing::Slot *BlockRing::acquireFilled()
+{
+    uint64_t t = this->tail.load(std::memory_order_relaxed);
+
+    for (;;)
+    {
+        uint64_t h = this->head.load(std::memory_order_acquire);
+
+        if (this->closed.load(std::memory_order_acquire))
+            return nullptr;
+
+        if (h != t)
+            return &this->slots[t % this->depth];
+
+        this->head.wait(h, std::memory_order_acquire);
+    }
+}
+
+void BlockRing::release()
+{
+    this->tail.fetch_add(1, std::memory_order_release);
+    this->tail.notify_one();
+}
+
+// Both counters are bumped after raising the flag so a side blocked in
+// wait() observes a new value, wakes and then sees the ring closed.
+void BlockRing::close()
+{
+    this->closed.store(true, std::memory_order_release);
+
+    this->head.fetch_add(1, std::memory_order_release);
+    this->head.notify_all();
+    this->tail.fetch_add(1, std::memory_order_release);
+    this->tail.notify_all();
+}
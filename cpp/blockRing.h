@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "metrics.h"
+
+#define PIPELINE_BUFFER_SIZE (256 * 1024)
+#define PIPELINE_BUFFER_ALIGNMENT 4096
+#define PIPELINE_MIN_DEPTH 2
+
+// Single-producer/single-consumer ring of page-aligned buffers used by the
+// pipelined RBG output. The producer fills slots with keystream while the
+// consumer drains them; handoff is two monotonic counters, and a side only
+// sleeps (futex-backed std::atomic::wait) when the ring is full or empty.
+class BlockRing
+{
+
+public:
+    struct Slot
+    {
+        uint8_t *data;
+        int length;
+        Metrics::Clock::duration generateTime;
+    };
+
+    BlockRing(int depth, int bufferSize);
+    ~BlockRing();
+
+    BlockRing(const BlockRing &) = delete;
+    BlockRing &operator=(const BlockRing &) = delete;
+
+    // Producer side: waits for a free slot, nullptr once the ring is closed
+    Slot *acquireFree();
+    void publish();
+
+    // Consumer side: waits for a filled slot, nullptr once the ring is closed
+    Slot *acquireFilled();
+    void release();
+
+    // Stops both sides; safe to call from either thread
+    void close();
+
+protected:
+    std::vector<Slot> slots;
+    uint64_t depth;
+
+    // advanced by the producer / consumer respectively, and by close()
+    alignas(64) std::atomic<uint64_t> head{0};
+    alignas(64) std::atomic<uint64_t> tail{0};
+    alignas(64) std::atomic<bool> closed{false};
+};
@@ -0,0 +1,594 @@
+#include "generator.h"
+#include "argon2Arena.h"
+#include <openssl/core.h>
+#include <openssl/core_dispatch.h>
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <sodium.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <cstring>
+
+// OpenSSL 3 provider exposing a D-RSA Generator as the "DRSA" EVP_RAND.
+//
+// The generator is configured through PW, CS, IC, patternBytes and threads,
+// either in the provider's openssl.cnf section (defaults for every instance)
+// or with EVP_RAND_CTX_set_params before the first draw. The expensive setup is
+// deferred to the first generate call, so DRBG instances OpenSSL creates but
+// never draws from (e.g. the primary of the public/private pair) cost nothing.
+// Parent DRBGs, entropy, nonces and additional input are ignored: the output
+// only depends on the parameters, which is the point of this provider.
+//
+// The setup runs once per provider and parameter set. Every instance then
+// draws from its own substream of that generator, so e.g. RAND_bytes never
+// reveals RAND_priv_bytes output. The label is the streamId parameter or,
+// when it is not set, the instance's role in its library context: "primary",
+// "public" or "private". Roles are looked up on the first draw, since
+// OpenSSL creates these DRBGs lazily, per thread and in any order; a role
+// label is held by one live instance at a time, so the public and private
+// DRBGs of a second thread need a streamId. Other instances always do. The
+// same bytes come out of RBG with --stream-id <label>.
+
+#define DRSA_RAND_NAME "DRSA"
+#define DRSA_RAND_PROPERTIES "provider=drsa"
+#define DRSA_RAND_STRENGTH 256
+#define DRSA_RAND_MAX_REQUEST (1 << 16)
+
+#define DRSA_PARAM_PW "PW"
+#define DRSA_PARAM_CS "CS"
+#define DRSA_PARAM_IC "IC"
+#define DRSA_PARAM_PATTERN_BYTES "patternBytes"
+#define DRSA_PARAM_THREADS "threads"
+#define DRSA_PARAM_STREAM_ID "streamId"
+#define DRSA_PARAM_INSTANCE_ID "instanceId"
+
+#define DRSA_ROLE_PRIMARY "primary"
+#define DRSA_ROLE_PUBLIC "public"
+#define DRSA_ROLE_PRIVATE "private"
+
+// Instances share one Argon2 arena, so a setup for new parameters in a
+// long-lived process reuses the same prefaulted memory. The last set-up
+// generator is kept under setupLock and only hands out substreams.
+struct ProviderContext
+{
+    GeneratorArgs defaults;
+    std::shared_ptr<Argon2Arena> arena;
+    OSSL_LIB_CTX *libctx = NULL;
+    std::atomic<uint64_t> instances{0};
+
+    std::mutex setupLock;
+    GeneratorArgs rootArgs;
+    std::unique_ptr<Generator> root;
+
+    std::mutex roleLock;
+    std::set<std::string> claimedRoles;
+};
+
+// The lock is recursive because looking up the instance's role reads its
+// parameters, which locks it again from inside generate
+struct RandContext
+{
+    ProviderContext *provider;
+    uint64_t instanceId;
+    bool chained;
+    GeneratorArgs args;
+    std::string streamId;
+    std::string role;
+    std::unique_ptr<Generator> generator;
+    std::unique_ptr<std::recursive_mutex> lock;
+    int state = EVP_RAND_STATE_UNINITIALISED;
+};
+
+static void wipeString(std::string &value)
+{
+    sodium_memzero(value.data(), value.size());
+    value.clear();
+}
+
+// Instance parameters go back to the provider defaults, and the password and
+// confusion string set on the instance are wiped rather than just released
+static void resetArgs(RandContext *ctx)
+{
+    wipeString(ctx->args.PW);
+    wipeString(ctx->args.CS);
+    ctx->args = ctx->provider->defaults;
+}
+
+// threads only changes how the setup is run, not its result
+static bool sameSetup(const GeneratorArgs &a, const GeneratorArgs &b)
+{
+    return a.PW == b.PW && a.CS == b.CS && a.IC == b.IC && a.patternBytes == b.patternBytes;
+}
+
+static bool isInstance(EVP_RAND_CTX *rand, uint64_t instanceId)
+{
+    uint64_t id;
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_uint64(DRSA_PARAM_INSTANCE_ID, &id),
+        OSSL_PARAM_construct_end()};
+
+    return rand != NULL && EVP_RAND_CTX_get_params(rand, params) && OSSL_PARAM_modified(params) && id == instanceId;
+}
+
+// Which of its library context's DRBGs the instance is, "" if none. The
+// primary is the only one without a parent; public and private are the
+// calling thread's.
+static std::string findRole(RandContext *ctx)
+{
+    OSSL_LIB_CTX *libctx = ctx->provider->libctx;
+
+    if (!ctx->chained)
+        return isInstance(RAND_get0_primary(libctx), ctx->instanceId) ? DRSA_ROLE_PRIMARY : "";
+
+    if (isInstance(RAND_get0_public(libctx), ctx->instanceId))
+        return DRSA_ROLE_PUBLIC;
+
+    if (isInstance(RAND_get0_private(libctx), ctx->instanceId))
+        return DRSA_ROLE_PRIVATE;
+
+    return "";
+}
+
+// The label of an instance without a streamId is its role, held until the
+// instance is uninstantiated; "" when it has none or another instance holds it
+static std::string claimRole(RandContext *ctx)
+{
+    std::string role = findRole(ctx);
+    if (role.empty())
+        return "";
+
+    std::lock_guard<std::mutex> guard(ctx->provider->roleLock);
+    if (!ctx->provider->claimedRoles.insert(role).second)
+        return "";
+
+    ctx->role = role;
+    return role;
+}
+
+static void releaseRole(RandContext *ctx)
+{
+    if (ctx->role.empty())
+        return;
+
+    std::lock_guard<std::mutex> guard(ctx->provider->roleLock);
+    ctx->provider->claimedRoles.erase(ctx->role);
+    ctx->role.clear();
+}
+
+// Sets up the provider's generator for args unless it already is, and
+// derives the instance's substream from it
+static std::unique_ptr<Generator> openStream(ProviderContext *provider, const GeneratorArgs &args, const std::string &label)
+{
+    std::lock_guard<std::mutex> guard(provider->setupLock);
+
+    if (!provider->root || !sameSetup(provider->rootArgs, args))
+    {
+        provider->root.reset();
+
+        std::unique_ptr<Generator> root = std::make_unique<Generator>(args);
+        root->setArgon2Arena(provider->arena);
+        root->setup();
+
+        provider->root = std::move(root);
+        provider->rootArgs = args;
+    }
+
+    return std::make_unique<Generator>(provider->root->substream(label));
+}
+
+static bool parseUnsigned(const char *text, int &value)
+{
+    try
+    {
+        size_t parsed;
+        value = std::stoi(text, &parsed);
+        return parsed == strlen(text) && value >= 0;
+    }
+    catch (std::exception &exception)
+    {
+        return false;
+    }
+}
+
+// Numeric parameters are accepted as integers or as strings, since values
+// coming from openssl.cnf or the command line are always strings
+static bool getIntParam(const OSSL_PARAM *param, int &value)
+{
+    if (param->data_type == OSSL_PARAM_UTF8_STRING)
+    {
+        const char *text;
+        return OSSL_PARAM_get_utf8_string_ptr(param, &text) && parseUnsigned(text, value);
+    }
+
+    return OSSL_PARAM_get_int(param, &value);
+}
+
+static bool getStringParam(const OSSL_PARAM *param, std::string &value)
+{
+    const char *text;
+
+    if (!OSSL_PARAM_get_utf8_string_ptr(param, &text))
+        return false;
+
+    value = text;
+    return true;
+}
+
+static bool applyGeneratorParams(GeneratorArgs &args, const OSSL_PARAM params[])
+{
+    const OSSL_PARAM *param;
+    int value;
+
+    if ((param = OSSL_PARAM_locate_const(params, DRSA_PARAM_PW)) != NULL && !getStringParam(param, args.PW))
+        return false;
+
+    if ((param = OSSL_PARAM_locate_const(params, DRSA_PARAM_CS)) != NULL && !getStringParam(param, args.CS))
+        return false;
+
+    if ((param = OSSL_PARAM_locate_const(params, DRSA_PARAM_IC)) != NULL)
+    {
+        if (!getIntParam(param, value) || value < 1 || value > UINT16_MAX)
+            return false;
+        args.IC = value;
+    }
+
+    if ((param = OSSL_PARAM_locate_const(params, DRSA_PARAM_PATTERN_BYTES)) != NULL)
+    {
+        if (!getIntParam(param, value) || value < 1 || value > MAX_PATTERN_BYTES)
+            return false;
+        args.patternBytes = value;
+    }
+
+    if ((param = OSSL_PARAM_locate_const(params, DRSA_PARAM_THREADS)) != NULL)
+    {
+        if (!getIntParam(param, value) || value < 1)
+            return false;
+        args.threads = value;
+    }
+
+    return true;
+}
+
+static void *drsaRandNew(void *provctx, void *parent, const OSSL_DISPATCH *parentCalls)
+{
+    RandContext *ctx = new (std::nothrow) RandContext();
+
+    if (ctx != NULL)
+    {
+        ctx->provider = static_cast<ProviderContext *>(provctx);
+        ctx->instanceId = ctx->provider->instances++;
+        ctx->chained = parent != NULL;
+        ctx->args = ctx->provider->defaults;
+    }
+
+    return ctx;
+}
+
+static void drsaRandFree(void *vctx)
+{
+    RandContext *ctx = static_cast<RandContext *>(vctx);
+
+    if (ctx != NULL)
+    {
+        releaseRole(ctx);
+        resetArgs(ctx);
+    }
+
+    delete ctx;
+}
+
+static int drsaRandInstantiate(void *vctx, unsigned int strength, int predictionResistance,
+                               const unsigned char *pstr, size_t pstrLen, const OSSL_PARAM params[])
+{
+    RandContext *ctx = static_cast<RandContext *>(vctx);
+
+    if (strength > DRSA_RAND_STRENGTH || !applyGeneratorParams(ctx->args, params))
+        return 0;
+
+    ctx->generator.reset();
+    ctx->state = EVP_RAND_STATE_READY;
+    return 1;
+}
+
+// The Generator wipes its key when destroyed
+static int drsaRandUninstantiate(void *vctx)
+{
+    RandContext *ctx = static_cast<RandContext *>(vctx);
+
+    ctx->generator.reset();
+    releaseRole(ctx);
+    resetArgs(ctx);
+    ctx->state = EVP_RAND_STATE_UNINITIALISED;
+    return 1;
+}
+
+static int drsaRandGenerate(void *vctx, unsigned char *out, size_t outLen, unsigned int strength,
+                            int predictionResistance, const unsigned char *adin, size_t adinLen)
+{
+    RandContext *ctx = static_cast<RandContext *>(vctx);
+
+    if (ctx->state != EVP_RAND_STATE_READY || strength > DRSA_RAND_STRENGTH || outLen > DRSA_RAND_MAX_REQUEST)
+        return 0;
+
+    try
+    {
+        if (!ctx->generator)
+        {
+            if (ctx->args.PW.empty() || ctx->args.CS.empty() || ctx->args.IC < 1)
+                return 0;
+
+            std::string label = !ctx->streamId.empty() ? ctx->streamId : claimRole(ctx);
+            if (label.empty())
+                return 0;
+
+            ctx->generator = openStream(ctx->provider, ctx->args, label);
+        }
+
+        ctx->generator->nextBlock(out, outLen);
+    }
+    catch (std::exception &exception)
+    {
+        ctx->state = EVP_RAND_STATE_ERROR;
+        return 0;
+    }
+
+    return 1;
+}
+
+// Reseeding would break reproducibility, so fresh entropy is ignored
+static int drsaRandReseed(void *vctx, int predictionResistance, const unsigned char *entropy, size_t entropyLen,
+                          const unsigned char *adin, size_t adinLen)
+{
+    return static_cast<RandContext *>(vctx)->state == EVP_RAND_STATE_READY;
+}
+
+static int drsaRandEnableLocking(void *vctx)
+{
+    RandContext *ctx = static_cast<RandContext *>(vctx);
+
+    if (!ctx->lock)
+        ctx->lock.reset(new (std::nothrow) std::recursive_mutex());
+
+    return ctx->lock != nullptr;
+}
+
+static int drsaRandLock(void *vctx)
+{
+    RandContext *ctx = static_cast<RandContext *>(vctx);
+
+    if (ctx->lock)
+        ctx->lock->lock();
+
+    return 1;
+}
+
+static void drsaRandUnlock(void *vctx)
+{
+    RandContext *ctx = static_cast<RandContext *>(vctx);
+
+    if (ctx->lock)
+        ctx->lock->unlock();
+}
+
+static const OSSL_PARAM *drsaRandGettableCtxParams(void *vctx, void *provctx)
+{
+    static const OSSL_PARAM gettable[] = {
+        OSSL_PARAM_int(OSSL_RAND_PARAM_STATE, NULL),
+        OSSL_PARAM_uint(OSSL_RAND_PARAM_STRENGTH, NULL),
+        OSSL_PARAM_size_t(OSSL_RAND_PARAM_MAX_REQUEST, NULL),
+        OSSL_PARAM_uint64(DRSA_PARAM_INSTANCE_ID, NULL),
+        OSSL_PARAM_END};
+
+    return gettable;
+}
+
+static int drsaRandGetCtxParams(void *vctx, OSSL_PARAM params[])
+{
+    RandContext *ctx = static_cast<RandContext *>(vctx);
+    OSSL_PARAM *param;
+
+    if ((param = OSSL_PARAM_locate(params, OSSL_RAND_PARAM_STATE)) != NULL && !OSSL_PARAM_set_int(param, ctx->state))
+        return 0;
+
+    if ((param = OSSL_PARAM_locate(params, OSSL_RAND_PARAM_STRENGTH)) != NULL && !OSSL_PARAM_set_uint(param, DRSA_RAND_STRENGTH))
+        return 0;
+
+    if ((param = OSSL_PARAM_locate(params, OSSL_RAND_PARAM_MAX_REQUEST)) != NULL && !OSSL_PARAM_set_size_t(param, DRSA_RAND_MAX_REQUEST))
+        return 0;
+
+    if ((param = OSSL_PARAM_locate(params, DRSA_PARAM_INSTANCE_ID)) != NULL && !OSSL_PARAM_set_uint64(param, ctx->instanceId))
+        return 0;
+
+    return 1;
+}
+
+static const OSSL_PARAM *drsaRandSettableCtxParams(void *vctx, void *provctx)
+{
+    static const OSSL_PARAM settable[] = {
+        OSSL_PARAM_utf8_string(DRSA_PARAM_PW, NULL, 0),
+        OSSL_PARAM_utf8_string(DRSA_PARAM_CS, NULL, 0),
+        OSSL_PARAM_int(DRSA_PARAM_IC, NULL),
+        OSSL_PARAM_int(DRSA_PARAM_PATTERN_BYTES, NULL),
+        OSSL_PARAM_int(DRSA_PARAM_THREADS, NULL),
+        OSSL_PARAM_utf8_string(DRSA_PARAM_STREAM_ID, NULL, 0),
+        OSSL_PARAM_END};
+
+    return settable;
+}
+
+// Parameters are picked up by the first generate call after instantiation,
+// so they can also be set on DRBGs libcrypto created itself. Unknown ones
+// (such as the reseed intervals libcrypto sets) are ignored.
+static int drsaRandSetCtxParams(void *vctx, const OSSL_PARAM params[])
+{
+    RandContext *ctx = static_cast<RandContext *>(vctx);
+    const OSSL_PARAM *param;
+
+    if (params == NULL)
+        return 1;
+
+    if ((param = OSSL_PARAM_locate_const(params, DRSA_PARAM_STREAM_ID)) != NULL && !getStringParam(param, ctx->streamId))
+        return 0;
+
+    return applyGeneratorParams(ctx->args, params);
+}
+
+// After uninstantiate the instance holds no generator, hence no key, and its
+// parameters are the provider defaults again
+static int drsaRandVerifyZeroization(void *vctx)
+{
+    RandContext *ctx = static_cast<RandContext *>(vctx);
+
+    return ctx->state == EVP_RAND_STATE_UNINITIALISED && !ctx->generator &&
+           ctx->args.PW == ctx->provider->defaults.PW && ctx->args.CS == ctx->provider->defaults.CS;
+}
+
+static const OSSL_DISPATCH drsaRandFunctions[] = {
+    {OSSL_FUNC_RAND_NEWCTX, (void (*)(void))drsaRandNew},
+    {OSSL_FUNC_RAND_FREECTX, (void (*)(void))drsaRandFree},
+    {OSSL_FUNC_RAND_INSTANTIATE, (void (*)(void))drsaRandInstantiate},
+    {OSSL_FUNC_RAND_UNINSTANTIATE, (void (*)(void))drsaRandUninstantiate},
+    {OSSL_FUNC_RAND_GENERATE, (void (*)(void))drsaRandGenerate},
+    {OSSL_FUNC_RAND_RESEED, (void (*)(void))drsaRandReseed},
+    {OSSL_FUNC_RAND_ENABLE_LOCKING, (void (*)(void))drsaRandEnableLocking},
+    {OSSL_FUNC_RAND_LOCK, (void (*)(void))drsaRandLock},
+    {OSSL_FUNC_RAND_UNLOCK, (void (*)(void))drsaRandUnlock},
+    {OSSL_FUNC_RAND_GETTABLE_CTX_PARAMS, (void (*)(void))drsaRandGettableCtxParams},
+    {OSSL_FUNC_RAND_GET_CTX_PARAMS, (void (*)(void))drsaRandGetCtxParams},
+    {OSSL_FUNC_RAND_SETTABLE_CTX_PARAMS, (void (*)(void))drsaRandSettableCtxParams},
+    {OSSL_FUNC_RAND_SET_CTX_PARAMS, (void (*)(void))drsaRandSetCtxParams},
+    {OSSL_FUNC_RAND_VERIFY_ZEROIZATION, (void (*)(void))drsaRandVerifyZeroization},
+    {0, NULL}};
+
+static const OSSL_ALGORITHM drsaRandAlgorithms[] = {
+    {DRSA_RAND_NAME, DRSA_RAND_PROPERTIES, drsaRandFunctions, "D-RSA deterministic generator"},
+    {NULL, NULL, NULL, NULL}};
+
+static const OSSL_ALGORITHM *drsaQuery(void *provctx, int operationId, int *noCache)
+{
+    *noCache = 0;
+    return operationId == OSSL_OP_RAND ? drsaRandAlgorithms : NULL;
+}
+
+static void drsaTeardown(void *provctx)
+{
+    ProviderContext *ctx = static_cast<ProviderContext *>(provctx);
+
+    wipeString(ctx->defaults.PW);
+    wipeString(ctx->defaults.CS);
+    wipeString(ctx->rootArgs.PW);
+    wipeString(ctx->rootArgs.CS);
+    delete ctx;
+}
+
+static const OSSL_PARAM *drsaGettableParams(void *provctx)
+{
+    static const OSSL_PARAM gettable[] = {
+        OSSL_PARAM_utf8_ptr(OSSL_PROV_PARAM_NAME, NULL, 0),
+        OSSL_PARAM_int(OSSL_PROV_PARAM_STATUS, NULL),
+        OSSL_PARAM_END};
+
+    return gettable;
+}
+
+static int drsaGetParams(void *provctx, OSSL_PARAM params[])
+{
+    OSSL_PARAM *param;
+
+    if ((param = OSSL_PARAM_locate(params, OSSL_PROV_PARAM_NAME)) != NULL && !OSSL_PARAM_set_utf8_ptr(param, "D-RSA Provider"))
+        return 0;
+
+    if ((param = OSSL_PARAM_locate(params, OSSL_PROV_PARAM_STATUS)) != NULL && !OSSL_PARAM_set_int(param, 1))
+        return 0;
+
+    return 1;
+}
+
+static const OSSL_DISPATCH drsaProviderFunctions[] = {
+    {OSSL_FUNC_PROVIDER_TEARDOWN, (void (*)(void))drsaTeardown},
+    {OSSL_FUNC_PROVIDER_GETTABLE_PARAMS, (void (*)(void))drsaGettableParams},
+    {OSSL_FUNC_PROVIDER_GET_PARAMS, (void (*)(void))drsaGetParams},
+    {OSSL_FUNC_PROVIDER_QUERY_OPERATION, (void (*)(void))drsaQuery},
+    {0, NULL}};
+
+// Reads the instance defaults from the provider's openssl.cnf section
+static bool readProviderDefaults(const OSSL_CORE_HANDLE *handle, const OSSL_DISPATCH *in, GeneratorArgs &defaults)
+{
+    OSSL_FUNC_core_get_params_fn *coreGetParams = NULL;
+
+    for (; in->function_id != 0; in++)
+    {
+        if (in->function_id == OSSL_FUNC_CORE_GET_PARAMS)
+            coreGetParams = OSSL_FUNC_core_get_params(in);
+    }
+
+    if (coreGetParams == NULL)
+        return true;
+
+    char *PW = NULL, *CS = NULL, *IC = NULL, *patternBytes = NULL, *threads = NULL;
+    OSSL_PARAM request[] = {
+        OSSL_PARAM_utf8_ptr(DRSA_PARAM_PW, &PW, 0),
+        OSSL_PARAM_utf8_ptr(DRSA_PARAM_CS, &CS, 0),
+        OSSL_PARAM_utf8_ptr(DRSA_PARAM_IC, &IC, 0),
+        OSSL_PARAM_utf8_ptr(DRSA_PARAM_PATTERN_BYTES, &patternBytes, 0),
+        OSSL_PARAM_utf8_ptr(DRSA_PARAM_THREADS, &threads, 0),
+        OSSL_PARAM_END};
+
+    if (!coreGetParams(handle, request))
+        return false;
+
+    // hand the strings that were found back through the same parser used
+    // for per-instance parameters
+    OSSL_PARAM found[6];
+    int n = 0;
+
+    if (PW != NULL)
+        found[n++] = OSSL_PARAM_construct_utf8_string(DRSA_PARAM_PW, PW, 0);
+    if (CS != NULL)
+        found[n++] = OSSL_PARAM_construct_utf8_string(DRSA_PARAM_CS, CS, 0);
+    if (IC != NULL)
+        found[n++] = OSSL_PARAM_construct_utf8_string(DRSA_PARAM_IC, IC, 0);
+    if (patternBytes != NULL)
+        found[n++] = OSSL_PARAM_construct_utf8_string(DRSA_PARAM_PATTERN_BYTES, patternBytes, 0);
+    if (threads != NULL)
+        found[n++] = OSSL_PARAM_construct_utf8_string(DRSA_PARAM_THREADS, threads, 0);
+    found[n] = OSSL_PARAM_construct_end();
+
+    return applyGeneratorParams(defaults, found);
+}
+
+extern "C" int OSSL_provider_init(const OSSL_CORE_HANDLE *handle, const OSSL_DISPATCH *in,
+                                  const OSSL_DISPATCH **out, void **provctx)
+{
+    ProviderContext *ctx = new (std::nothrow) ProviderContext();
+
+    if (ctx == NULL)
+        return 0;
+
+    ctx->defaults.IC = 0;
+    ctx->defaults.patternBytes = PatternBytes;
+    ctx->arena = std::make_shared<Argon2Arena>();
+
+    // outside the FIPS module the core context is the library context the
+    // provider was loaded into, where the roles of the instances are looked up
+    for (const OSSL_DISPATCH *function = in; function->function_id != 0; function++)
+    {
+        if (function->function_id == OSSL_FUNC_CORE_GET_LIBCTX)
+            ctx->libctx = (OSSL_LIB_CTX *)OSSL_FUNC_core_get_libctx(function)(handle);
+    }
+
+    if (!readProviderDefaults(handle, in, ctx->defaults))
+    {
+        delete ctx;
+        return 0;
+    }
+
+    *out = drsaProviderFunctions;
+    *provctx = ctx;
+    return 1;
+}
@@ -1,20 +1,110 @@
 #include "generator.h"
 #include "generatorException.h"
+#include "argon2Arena.h"
+#include "setupCheckpoint.h"
+#include "probes.h"
 #include <stdio.h>
 #include <argon2.h>
 #include <cstring>
 #include <sodium.h>
+#include <openssl/kdf.h>
+#include <openssl/core_names.h>
+#include <openssl/params.h>
 #include <math.h>
 #include <algorithm>
 #include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
 
 Generator::Generator(GeneratorArgs args)
 {
     this->args = args;
 
+    if (args.patternBytes < 1 || args.patternBytes > MAX_PATTERN_BYTES)
+        throw GeneratorException("Invalid number of pattern bytes", GeneratorExceptionTypes::GENERATOR_SETUP_ERROR);
+
+    if (args.threads < 1)
+        throw GeneratorException("Invalid number of threads", GeneratorExceptionTypes::GENERATOR_SETUP_ERROR);
+
     if(sodium_init() < 0)
         throw GeneratorException("Unable to initialize sodium", GeneratorExceptionTypes::GENERATOR_SETUP_ERROR);
 
+    this->cipher.ctx = EVP_CIPHER_CTX_new();
+    this->digest.ctx = EVP_MD_CTX_new();
+
+    if (this->cipher.ctx == NULL || this->digest.ctx == NULL)
+    {
+        releaseContexts();
+        throw GeneratorException("Error creating OpenSSL contexts", GeneratorExceptionTypes::GENERATOR_SETUP_ERROR);
+    }
+}
+
+// Freeing the cipher context clears its key schedule; the key, password and
+// confusion string copies held here are wiped explicitly
+Generator::~Generator()
+{
+    releaseContexts();
+
+    sodium_memzero(this->key.bytes, sizeof(this->key.bytes));
+    sodium_memzero(this->args.PW.data(), this->args.PW.size());
+    sodium_memzero(this->args.CS.data(), this->args.CS.size());
+}
+
+Generator::Generator(Generator &&other) noexcept
+    : args(std::move(other.args)), cipher(other.cipher), digest(other.digest),
+      key(other.key), keystreamOffset(other.keystreamOffset),
+      argon2Arena(std::move(other.argon2Arena)), checkpointFile(std::move(other.checkpointFile)),
+      checkpointInterval(other.checkpointInterval), setupDone(other.setupDone)
+{
+    other.cipher.ctx = NULL;
+    other.digest.ctx = NULL;
+    other.setupDone = false;
+}
+
+Generator &Generator::operator=(Generator &&other) noexcept
+{
+    if (this != &other)
+    {
+        releaseContexts();
+
+        this->args = std::move(other.args);
+        this->cipher = other.cipher;
+        this->digest = other.digest;
+        this->key = other.key;
+        this->keystreamOffset = other.keystreamOffset;
+        this->argon2Arena = std::move(other.argon2Arena);
+        this->checkpointFile = std::move(other.checkpointFile);
+        this->checkpointInterval = other.checkpointInterval;
+        this->setupDone = other.setupDone;
+
+        other.cipher.ctx = NULL;
+        other.digest.ctx = NULL;
+        other.setupDone = false;
+    }
+
+    return *this;
+}
+
+void Generator::setArgon2Arena(std::shared_ptr<Argon2Arena> arena)
+{
+    this->argon2Arena = std::move(arena);
+}
+
+void Generator::setCheckpointFile(const std::string &path, std::chrono::seconds interval)
+{
+    this->checkpointFile = path;
+    this->checkpointInterval = interval;
+}
+
+void Generator::releaseContexts()
+{
+    EVP_CIPHER_CTX_free(this->cipher.ctx);
+    EVP_MD_CTX_free(this->digest.ctx);
+
+    this->cipher.ctx = NULL;
+    this->digest.ctx = NULL;
 }
 
 uint8_t const Generator::zerosArray[4096] = {0};
@@ -25,19 +115,53 @@ void Generator::setup()
     Pattern pattern;
     pattern.size = this->args.patternBytes;
 
+    DRSA_PROBE2(setup_start, this->args.IC, this->args.patternBytes);
+
     findBootstrapSeed(this->args, bootstrapSeed);
 
+    DRSA_PROBE1(bootstrap_done, this->args.IC);
+
     Generator::generatePattern(pattern, this->args.CS);
 
-    initializeGenerator(bootstrapSeed);
+    std::unique_ptr<SetupCheckpoint> checkpoint;
+    uint32_t firstIteration = 0;
+    Seed startSeed = bootstrapSeed;
+
+    if (!this->checkpointFile.empty())
+    {
+        checkpoint = std::make_unique<SetupCheckpoint>(this->checkpointFile, this->args, bootstrapSeed.bytes);
+
+        // without a checkpoint to resume, save one right away so an unusable
+        // path fails now rather than after the first interval
+        if (checkpoint->load(firstIteration, startSeed.bytes))
+            DRSA_PROBE1(checkpoint_resume, firstIteration);
+        else
+            checkpoint->save(0, bootstrapSeed.bytes);
+    }
+
+    initializeGenerator(startSeed);
+    std::chrono::steady_clock::time_point lastSave = std::chrono::steady_clock::now();
 
-    for (uint32_t i = 0; i < this->args.IC; i++)
+    for (uint32_t i = firstIteration; i < this->args.IC; i++)
     {
         findNextSeedByPattern(pattern, iterationSeed);
         initializeGenerator(iterationSeed);
+
+        if (checkpoint && std::chrono::steady_clock::now() - lastSave >= this->checkpointInterval)
+        {
+            checkpoint->save(i + 1, iterationSeed.bytes);
+            lastSave = std::chrono::steady_clock::now();
+        }
     }
 
+    if (checkpoint)
+        checkpoint->remove();
+
+    sodium_memzero(bootstrapSeed.bytes, sizeof(bootstrapSeed.bytes));
+    sodium_memzero(iterationSeed.bytes, sizeof(iterationSeed.bytes));
+    sodium_memzero(startSeed.bytes, sizeof(startSeed.bytes));
     setupDone = true;
+    DRSA_PROBE1(setup_done, this->args.IC);
 }
 
 void Generator::nextBlock(uint8_t *block, int blockLength)
@@ -48,18 +172,86 @@ void Generator::nextBlock(uint8_t *block, int blockLength)
     this->seekNextBytesFromGenerator(block, blockLength);
 }
 
+Generator Generator::substream(const std::string &label) const
+{
+    if (!setupDone)
+        throw GeneratorException("Could not call Generator::substream without calling Generator::setup()", GeneratorExceptionTypes::GENERATOR_RUNTIME_ERROR);
+
+    // key still holds the last setup seed: output never re-keys the cipher
+    Seed childKey;
+    Seed parentKey = this->key;
+    char digestName[] = "SHA256";
+    char salt[] = SUBSTREAM_HKDF_SALT;
+    std::string info = label;
+
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST, digestName, 0),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_KEY, parentKey.bytes, sizeof(parentKey.bytes)),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SALT, salt, strlen(salt)),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_INFO, info.data(), info.size()),
+        OSSL_PARAM_construct_end()};
+
+    EVP_KDF *kdf = EVP_KDF_fetch(NULL, "HKDF", NULL);
+    EVP_KDF_CTX *kdfCtx = kdf != NULL ? EVP_KDF_CTX_new(kdf) : NULL;
+    int derived = kdfCtx != NULL && EVP_KDF_derive(kdfCtx, childKey.bytes, sizeof(childKey.bytes), params) == 1;
+
+    EVP_KDF_CTX_free(kdfCtx);
+    EVP_KDF_free(kdf);
+    sodium_memzero(parentKey.bytes, sizeof(parentKey.bytes));
+
+    if (!derived)
+        throw GeneratorException("Error while deriving substream key", GeneratorExceptionTypes::GENERATOR_RUNTIME_ERROR);
+
+    Generator child(this->args);
+    child.argon2Arena = this->argon2Arena;
+    child.initializeGenerator(childKey);
+    child.setupDone = true;
+    sodium_memzero(childKey.bytes, sizeof(childKey.bytes));
+
+    return child;
+}
+
 void Generator::seekNextBytesFromGenerator(uint8_t *out, int blockLength)
+{
+    Generator::encryptZeros(this->cipher.ctx, out, blockLength);
+    this->keystreamOffset += blockLength;
+}
+
+void Generator::encryptZeros(EVP_CIPHER_CTX *ctx, uint8_t *out, int blockLength)
 {
     int outLen;
     int encryptedBytes = 0;
 
-    do
+    // encrypt the zeros array in chunks so blocks larger than it are fully filled
+    while (encryptedBytes < blockLength)
     {
-        EVP_EncryptUpdate(this->cipher.ctx, &out[0] + encryptedBytes, &outLen, zerosArray, blockLength % ZEROS_ARRAY_SIZE);
+        int chunk = std::min(blockLength - encryptedBytes, ZEROS_ARRAY_SIZE);
+
+        if (EVP_EncryptUpdate(ctx, &out[0] + encryptedBytes, &outLen, zerosArray, chunk) != 1)
+            throw GeneratorException("Error while generating bytes", GeneratorExceptionTypes::GENERATOR_RUNTIME_ERROR);
+
         encryptedBytes += outLen;
-        blockLength -= ZEROS_ARRAY_SIZE;
+    }
+}
+
+// Writes the keystream of the current key starting at an arbitrary offset.
+// ChaCha20 is counter-addressable: OpenSSL takes the 64-byte block counter in
+// the first IV bytes and carries it into the (zero) nonce, so a 64-bit block
+// index in little endian addresses the same stream as sequential reads.
+void Generator::keystreamAt(EVP_CIPHER_CTX *ctx, uint64_t offset, uint8_t *out, int blockLength) const
+{
+    uint8_t iv[16] = {0};
+    uint64_t block = offset / 64;
+    uint8_t skipped[64];
 
-    } while (encryptedBytes < blockLength);
+    for (int i = 0; i < 8; i++)
+        iv[i] = (uint8_t)(block >> (8 * i));
+
+    if (EVP_EncryptInit_ex(ctx, this->cipher.cipher, NULL, this->key.bytes, iv) != 1)
+        throw GeneratorException("Error while seeking generator", GeneratorExceptionTypes::GENERATOR_RUNTIME_ERROR);
+
+    Generator::encryptZeros(ctx, skipped, offset % 64);
+    Generator::encryptZeros(ctx, out, blockLength);
 }
 
 void Generator::generatePattern(Pattern &pattern, std::string confusionString)
@@ -107,13 +299,40 @@ void Generator::findBootstrapSeed(const GeneratorArgs &args, Seed &seed)
     const char* PW = args.PW.c_str();
     const int PW_Len = strlen(PW);
 
-    int status = argon2_hash(
-        iterations, memoryUsage, 1,
-        PW, PW_Len,
-        salt, 16,
-        seed.bytes, sizeof(seed.bytes),
-        nullptr, 0,
-        Argon2_i, ARGON2_VERSION_NUMBER);
+    int status;
+
+    if (this->argon2Arena)
+    {
+        // same parameters argon2_hash uses, with the arena as allocator
+        std::string password(PW, PW_Len);
+        argon2_context context = {};
+
+        context.out = seed.bytes;
+        context.outlen = sizeof(seed.bytes);
+        context.pwd = (uint8_t *)password.data();
+        context.pwdlen = PW_Len;
+        context.salt = salt;
+        context.saltlen = 16;
+        context.t_cost = iterations;
+        context.m_cost = memoryUsage;
+        context.lanes = 1;
+        context.threads = 1;
+        context.version = ARGON2_VERSION_NUMBER;
+        context.flags = ARGON2_DEFAULT_FLAGS;
+
+        status = this->argon2Arena->hash(context, Argon2_i);
+        sodium_memzero(password.data(), password.size());
+    }
+    else
+    {
+        status = argon2_hash(
+            iterations, memoryUsage, 1,
+            PW, PW_Len,
+            salt, 16,
+            seed.bytes, sizeof(seed.bytes),
+            nullptr, 0,
+            Argon2_i, ARGON2_VERSION_NUMBER);
+    }
 
     if (status != 0) {
         throw GeneratorException("Error while calculating Argon2 Bootstrap Seed", GeneratorExceptionTypes::GENERATOR_SETUP_ERROR);
@@ -139,74 +358,226 @@ void Generator::setArgon2Salt(unsigned char* salt, const char* CS, int IC) {
 
 void Generator::initializeGenerator(Seed &seed)
 {
-    if (this->cipher.ctx != NULL)
-        EVP_CIPHER_CTX_free(this->cipher.ctx);
+    if (EVP_CIPHER_CTX_reset(this->cipher.ctx) != 1 ||
+        EVP_EncryptInit_ex(this->cipher.ctx, this->cipher.cipher, NULL, seed.bytes, NULL) != 1)
+        throw GeneratorException("Error while initializing generator", GeneratorExceptionTypes::GENERATOR_SETUP_ERROR);
 
-    this->cipher.ctx = EVP_CIPHER_CTX_new();
+    this->key = seed;
+    this->keystreamOffset = 0;
 
-    if (EVP_EncryptInit(this->cipher.ctx, this->cipher.cipher, seed.bytes, NULL) != 1)
-        throw GeneratorException("Error while initializing generator", GeneratorExceptionTypes::GENERATOR_SETUP_ERROR);
+    DRSA_PROBE1(generator_init, this);
 }
 
-void Generator::calculateSeed(Seed &outSeed, const SHA256Result &hashResult, const LeadingPatternBytes &leadingBytes)
+void Generator::calculateSeed(Seed &outSeed, const SHA256Result &hashResult, const LeadingPatternBytes &leadingBytes, EVP_MD_CTX *ctx)
 {
-    auto ctx = EVP_MD_CTX_new();
+    EVP_MD_CTX *mdCtx = ctx != NULL ? ctx : EVP_MD_CTX_new();
 
-    EVP_DigestInit(ctx, EVP_sha256());
-    EVP_DigestUpdate(ctx, hashResult.bytes, sizeof(hashResult.bytes));
-    EVP_DigestUpdate(ctx, leadingBytes.bytes, sizeof(leadingBytes.bytes));
+    EVP_DigestInit_ex(mdCtx, EVP_sha256(), NULL);
+    EVP_DigestUpdate(mdCtx, hashResult.bytes, sizeof(hashResult.bytes));
+    EVP_DigestUpdate(mdCtx, leadingBytes.bytes, sizeof(leadingBytes.bytes));
 
     unsigned int mdLen;
-    EVP_DigestFinal(ctx, &outSeed.bytes[0], &mdLen);
-    EVP_MD_CTX_free(ctx);
+    EVP_DigestFinal_ex(mdCtx, &outSeed.bytes[0], &mdLen);
+
+    if (ctx == NULL)
+        EVP_MD_CTX_free(mdCtx);
 }
 
+// Returns the first position among the given ones where the pattern starts,
+// reading up to pattern.size - 1 bytes past the last position
+const uint8_t *Generator::findPattern(const uint8_t *data, int positions, const Pattern &pattern)
+{
+    const uint8_t *end = data + positions;
+    const uint8_t *candidate = data;
+
+    while (candidate < end && (candidate = (const uint8_t *)memchr(candidate, pattern.bytes[0], end - candidate)) != NULL)
+    {
+        if (memcmp(candidate, pattern.bytes.data(), pattern.size) == 0)
+            return candidate;
+        candidate++;
+    }
+
+    return NULL;
+}
+
+// Scans the keystream for the first occurrence of the pattern. Every byte
+// before the match is hashed, and the seed is derived from that hash and the
+// 32 bytes that follow the match. The keystream is read in chunks, so it may
+// run ahead of the match; that is fine because the generator is re-keyed with
+// the new seed right after.
 void Generator::findNextSeedByPattern(const Pattern &pattern, Seed &seed)
 {
+    if (this->args.threads > 1 && pattern.size >= PARALLEL_SCAN_MIN_PATTERN_BYTES)
+    {
+        findNextSeedByPatternParallel(pattern, seed);
+        return;
+    }
 
+    const int patternSize = pattern.size;
+    const uint64_t base = this->keystreamOffset;
 
-    auto mdCtx = EVP_MD_CTX_new();
-    EVP_DigestInit(mdCtx, EVP_sha256());
+    // the last patternSize - 1 bytes of a chunk are carried into the next one
+    uint8_t buffer[PATTERN_SCAN_BUFFER_SIZE + MAX_PATTERN_BYTES];
+    int bufferLength = 0;
 
-    uint8_t B;
     SHA256Result result;
     LeadingPatternBytes leading;
 
+    EVP_DigestInit_ex(this->digest.ctx, this->digest.md, NULL);
 
-    std::vector<uint8_t> currPattern = std::vector<uint8_t>();
-    uint8_t* block = new uint8_t[pattern.size];
-    seekNextBytesFromGenerator(block, pattern.size);
-    
-    for(int i=0;i<pattern.size;i++) {
-        currPattern.push_back(block[i]);
+    for (;;)
+    {
+        seekNextBytesFromGenerator(buffer + bufferLength, PATTERN_SCAN_BUFFER_SIZE);
+        bufferLength += PATTERN_SCAN_BUFFER_SIZE;
+
+        const uint8_t *match = Generator::findPattern(buffer, bufferLength - patternSize + 1, pattern);
+
+        if (match != NULL)
+        {
+            int matchOffset = match - buffer;
+            DRSA_PROBE2(pattern_match, this->keystreamOffset - bufferLength + matchOffset - base, patternSize);
+
+            EVP_DigestUpdate(this->digest.ctx, buffer, matchOffset);
+            EVP_DigestFinal_ex(this->digest.ctx, result.bytes, NULL);
+
+            int available = std::min(bufferLength - matchOffset - patternSize, (int)sizeof(leading.bytes));
+            memcpy(leading.bytes, match + patternSize, available);
+
+            if (available < (int)sizeof(leading.bytes))
+                seekNextBytesFromGenerator(leading.bytes + available, sizeof(leading.bytes) - available);
+
+            Generator::calculateSeed(seed, result, leading, this->digest.ctx);
+            return;
+        }
+
+        int hashed = bufferLength - (patternSize - 1);
+        EVP_DigestUpdate(this->digest.ctx, buffer, hashed);
+        memmove(buffer, buffer + hashed, patternSize - 1);
+        bufferLength = patternSize - 1;
     }
+}
+
+// Same result as the serial search, with the keystream split into segments
+// that worker threads generate and scan independently by seeking the ChaCha20
+// counter. SHA-256 cannot be split, so this thread hashes the segments in
+// order as they complete; the first segment holding a match therefore gives
+// the earliest match. At most 2 * threads segments are in flight, which
+// bounds both memory and the work wasted past the match.
+void Generator::findNextSeedByPatternParallel(const Pattern &pattern, Seed &seed)
+{
+    struct Segment
+    {
+        std::vector<uint8_t> bytes;
+        int64_t index = -1;
+        int64_t match = -1;
+    };
+
+    const int workers = this->args.threads;
+    const int64_t window = 2 * workers;
+    const uint64_t base = this->keystreamOffset;
+
+    std::vector<Segment> segments(window);
+    std::mutex mutex;
+    std::condition_variable segmentReady, slotFree;
+    int64_t nextSegment = 0, hashedSegments = 0;
+    bool stop = false;
+    std::exception_ptr error;
+
+    auto worker = [&]()
+    {
+        EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+
+        try
+        {
+            if (ctx == NULL)
+                throw GeneratorException("Error creating EVP_CIPHER_CTX", GeneratorExceptionTypes::GENERATOR_SETUP_ERROR);
+
+            for (;;)
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                slotFree.wait(lock, [&]
+                              { return stop || nextSegment - hashedSegments < window; });
+                if (stop)
+                    break;
+
+                int64_t index = nextSegment++;
+                Segment &segment = segments[index % window];
+                lock.unlock();
+
+                // overlap the next segment so matches across the boundary are found
+                segment.bytes.resize(PARALLEL_SCAN_SEGMENT_SIZE + pattern.size - 1);
+                this->keystreamAt(ctx, base + index * PARALLEL_SCAN_SEGMENT_SIZE, segment.bytes.data(), segment.bytes.size());
+
+                const uint8_t *match = Generator::findPattern(segment.bytes.data(), PARALLEL_SCAN_SEGMENT_SIZE, pattern);
+
+                lock.lock();
+                segment.match = match != NULL ? match - segment.bytes.data() : -1;
+                segment.index = index;
+                segmentReady.notify_all();
+            }
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            error = std::current_exception();
+            stop = true;
+            segmentReady.notify_all();
+            slotFree.notify_all();
+        }
 
-    delete[] block;
+        EVP_CIPHER_CTX_free(ctx);
+    };
 
+    std::vector<std::thread> threads;
+    for (int i = 0; i < workers; i++)
+        threads.emplace_back(worker);
 
-    for (;;)
+    SHA256Result result;
+    LeadingPatternBytes leading;
+    int64_t matchOffset = -1;
+
+    EVP_DigestInit_ex(this->digest.ctx, this->digest.md, NULL);
+
+    for (int64_t index = 0; matchOffset < 0; index++)
     {
+        Segment &segment = segments[index % window];
 
-        if(currPattern.size() == (long unsigned int)(pattern.size + 1))
-            currPattern.erase(currPattern.begin());
+        std::unique_lock<std::mutex> lock(mutex);
+        segmentReady.wait(lock, [&]
+                          { return error || segment.index == index; });
+        if (error)
+            break;
+        lock.unlock();
 
+        EVP_DigestUpdate(this->digest.ctx, segment.bytes.data(), segment.match >= 0 ? segment.match : PARALLEL_SCAN_SEGMENT_SIZE);
 
-        if (currPattern.size() == (long unsigned int)this->args.patternBytes && std::equal(currPattern.begin(), currPattern.end(),  pattern.bytes.begin(), pattern.bytes.end()))
+        lock.lock();
+        if (segment.match >= 0)
         {
-            EVP_DigestFinal(mdCtx, result.bytes, NULL);
-
-            this->seekNextBytesFromGenerator(leading.bytes, 32);
-            Generator::calculateSeed(seed, result, leading);
-            EVP_MD_CTX_free(mdCtx);
-            return;
+            matchOffset = index * PARALLEL_SCAN_SEGMENT_SIZE + segment.match;
+            stop = true;
         }
         else
         {
-            EVP_DigestUpdate(mdCtx, &currPattern.data()[0], 1);
-            this->seekNextBytesFromGenerator(&B, 1);
-            currPattern.push_back(B);
+            hashedSegments = index + 1;
         }
+        slotFree.notify_all();
     }
+
+    for (std::thread &thread : threads)
+        thread.join();
+
+    if (error)
+        std::rethrow_exception(error);
+
+    EVP_DigestFinal_ex(this->digest.ctx, result.bytes, NULL);
+    DRSA_PROBE2(pattern_match, matchOffset, pattern.size);
+
+    // the main context is re-keyed right after, so it is free to seek
+    this->keystreamAt(this->cipher.ctx, base + matchOffset + pattern.size, leading.bytes, sizeof(leading.bytes));
+    this->keystreamOffset = base + matchOffset + pattern.size + sizeof(leading.bytes);
+
+    Generator::calculateSeed(seed, result, leading, this->digest.ctx);
 }
 
 
@@ -4,9 +4,19 @@
 #include <bitset>
 #include <openssl/evp.h>
 #include <vector>
+#include <memory>
+#include <chrono>
 
 #define PatternBytes 2
+#define MAX_PATTERN_BYTES 32
 #define ZEROS_ARRAY_SIZE 4096
+#define PATTERN_SCAN_BUFFER_SIZE 4096
+#define PARALLEL_SCAN_SEGMENT_SIZE (1 << 20)
+#define PARALLEL_SCAN_MIN_PATTERN_BYTES 3
+#define SUBSTREAM_HKDF_SALT "D-RSA substream"
+#define CHECKPOINT_INTERVAL_SECONDS 60
+
+class Argon2Arena;
 
 struct GeneratorArgs
 {
@@ -14,6 +24,8 @@ struct GeneratorArgs
     std::string CS;
     uint16_t IC;
     int patternBytes;
+    // threads used by the pattern search, see findNextSeedByPatternParallel
+    int threads = 1;
 };
 
 class Generator
@@ -21,25 +33,59 @@ class Generator
 
 public:
     Generator(GeneratorArgs args);
+    ~Generator();
+
+    // Owns OpenSSL contexts, so it can be moved but not copied
+    Generator(const Generator &) = delete;
+    Generator &operator=(const Generator &) = delete;
+    Generator(Generator &&other) noexcept;
+    Generator &operator=(Generator &&other) noexcept;
 
     // Runs setup algorithm
     void setup();
 
+    // Takes Argon2 memory from a persistent arena instead of letting
+    // libargon2 map and fault a fresh region on every setup; the arena can
+    // be shared by many generators
+    void setArgon2Arena(std::shared_ptr<Argon2Arena> arena);
+
+    // Makes setup() save its progress to path at most every interval and
+    // resume from it when a previous run with the same parameters was cut
+    // short; the file is removed once setup completes (see SetupCheckpoint)
+    void setCheckpointFile(const std::string &path, std::chrono::seconds interval = std::chrono::seconds(CHECKPOINT_INTERVAL_SECONDS));
+
     void nextBlock(uint8_t *block, int blockLength);
 
+    // Child generator keyed with HKDF-SHA256 (salt SUBSTREAM_HKDF_SALT,
+    // input key the final setup seed, info the label bytes), ready without a
+    // setup of its own. Distinct labels give unrelated ChaCha20 keys, so
+    // children share no keystream with each other or with this generator,
+    // whose output is left untouched
+    Generator substream(const std::string &label) const;
+
 protected:
+    // Runs the setup and output of many generators in SIMD lockstep
+    friend class GeneratorBatch;
+
     struct Pattern
     {
         std::vector<uint8_t> bytes;
         int size;
     };
 
+    // Both contexts are allocated once and re-initialized on every use
     struct Cipher
     {
         const EVP_CIPHER *cipher = EVP_chacha20();
         EVP_CIPHER_CTX *ctx = NULL;
     };
 
+    struct Digest
+    {
+        const EVP_MD *md = EVP_sha256();
+        EVP_MD_CTX *ctx = NULL;
+    };
+
     struct _32Bytes
     {
         uint8_t bytes[32];
@@ -52,16 +98,30 @@ protected:
     void findBootstrapSeed(const GeneratorArgs &args, Seed &seed);
     void initializeGenerator(Seed &seed);
     void findNextSeedByPattern(const Pattern &pattern, Seed &seed);
+    void findNextSeedByPatternParallel(const Pattern &pattern, Seed &seed);
     void seekNextBytesFromGenerator(uint8_t *out, int nbytes);
+    void keystreamAt(EVP_CIPHER_CTX *ctx, uint64_t offset, uint8_t *out, int nbytes) const;
+
+    static void encryptZeros(EVP_CIPHER_CTX *ctx, uint8_t *out, int nbytes);
+    static const uint8_t *findPattern(const uint8_t *data, int positions, const Pattern &pattern);
 
     static void generatePattern(Pattern &pattern, const std::string confusionString);
     static int getArgon2MemoryUsageByIC(int IC);
     static int getArgon2IterationsByIC(int IC);
     static void setArgon2Salt(unsigned char* salt, const char* CS, int IC);
 
-    static void calculateSeed(Seed &outSeed, const SHA256Result &result, const LeadingPatternBytes &leadingBytes);
+    static void calculateSeed(Seed &outSeed, const SHA256Result &result, const LeadingPatternBytes &leadingBytes, EVP_MD_CTX *ctx = NULL);
+    void releaseContexts();
+
     GeneratorArgs args;
     Cipher cipher;
+    Digest digest;
+    // current key and how many keystream bytes were consumed since keying
+    Seed key;
+    uint64_t keystreamOffset = 0;
+    std::shared_ptr<Argon2Arena> argon2Arena;
+    std::string checkpointFile;
+    std::chrono::seconds checkpointInterval{CHECKPOINT_INTERVAL_SECONDS};
     bool setupDone = false;
     static const uint8_t zerosArray[ZEROS_ARRAY_SIZE];
 };
\ No newline at end of file
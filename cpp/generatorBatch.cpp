@@ -0,0 +1,719 @@
+#include "generatorBatch.h"
+#include "generatorException.h"
+#include "argon2Arena.h"
+#include "probes.h"
+#include <cstring>
+#include <algorithm>
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "keystream serialization assumes a little-endian host");
+static_assert(MAX_PATTERN_BYTES + 32 <= 64, "a match starting in a block, and the bytes after it, must end within the next block");
+
+// One state word of every lane; vector_size cannot depend on a template
+// parameter directly, hence the specializations
+template <int Lanes>
+struct LaneVector;
+
+template <>
+struct LaneVector<4>
+{
+    typedef uint32_t type __attribute__((vector_size(16)));
+};
+
+template <>
+struct LaneVector<8>
+{
+    typedef uint32_t type __attribute__((vector_size(32)));
+};
+
+template <>
+struct LaneVector<16>
+{
+    typedef uint32_t type __attribute__((vector_size(64)));
+};
+
+// Word-major like LaneKeys: each row holds one word of every lane. Flags are
+// all ones for set, so they can be used as blend masks.
+struct BatchSearchState
+{
+    // SHA-256 state over the blocks hashed so far
+    alignas(64) uint32_t digest[8][BATCH_MAX_LANES];
+
+    // The last two keystream blocks. A match starting in the previous block
+    // may run into the current one, so a block is scanned, and only then
+    // hashed, once the block after it exists.
+    alignas(64) uint32_t previous[16][BATCH_MAX_LANES];
+    alignas(64) uint32_t current[16][BATCH_MAX_LANES];
+    alignas(64) uint32_t hasPrevious[BATCH_MAX_LANES];
+    alignas(64) uint32_t hasCurrent[BATCH_MAX_LANES];
+    alignas(64) uint32_t active[BATCH_MAX_LANES];
+
+    // First two pattern bytes as a little-endian 16-bit value, and the mask
+    // of the bytes that count (the second one only for longer patterns)
+    alignas(64) uint32_t patternHead[BATCH_MAX_LANES];
+    alignas(64) uint32_t patternHeadMask[BATCH_MAX_LANES];
+};
+
+#define ROTATE(v, bits) (((v) << (bits)) | ((v) >> (32 - (bits))))
+#define ROTATE_RIGHT(v, bits) ROTATE(v, 32 - (bits))
+
+// SHA-256 reads big-endian words, ChaCha20 writes little-endian ones
+#define BYTE_SWAP(v) ((ROTATE(v, 8) & 0x00ff00ffu) | (ROTATE(v, 24) & 0xff00ff00u))
+
+// mask lanes are all ones or all zeros
+#define BLEND(mask, ifSet, otherwise) (((ifSet) & (mask)) | ((otherwise) & ~(mask)))
+
+static const uint32_t sha256InitialState[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+static const uint32_t sha256RoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+// SHA-256 compression function over any Word type with the usual operators:
+// a vector of lanes in the search kernel, plain uint32_t to finish a lane
+template <typename Word>
+static inline __attribute__((always_inline)) void sha256Compress(Word state[8], Word w[16])
+{
+    Word a = state[0], b = state[1], c = state[2], d = state[3];
+    Word e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int i = 0; i < 64; i++)
+    {
+        if (i >= 16)
+        {
+            Word x = w[(i - 15) & 15], y = w[(i - 2) & 15];
+            w[i & 15] += (ROTATE_RIGHT(x, 7) ^ ROTATE_RIGHT(x, 18) ^ (x >> 3)) + w[(i - 7) & 15] +
+                         (ROTATE_RIGHT(y, 17) ^ ROTATE_RIGHT(y, 19) ^ (y >> 10));
+        }
+
+        Word t1 = h + (ROTATE_RIGHT(e, 6) ^ ROTATE_RIGHT(e, 11) ^ ROTATE_RIGHT(e, 25)) + ((e & f) ^ (~e & g)) +
+                  sha256RoundConstants[i] + w[i & 15];
+        Word t2 = (ROTATE_RIGHT(a, 2) ^ ROTATE_RIGHT(a, 13) ^ ROTATE_RIGHT(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+        h = g, g = f, f = e, e = d + t1;
+        d = c, c = b, b = a, a = t1 + t2;
+    }
+
+    state[0] += a, state[1] += b, state[2] += c, state[3] += d;
+    state[4] += e, state[5] += f, state[6] += g, state[7] += h;
+}
+
+// Pads and hashes the last tailLength (< 64) bytes of a message whose first
+// hashedBytes are already in digest
+static void sha256Finish(const uint32_t digest[8], uint64_t hashedBytes, const uint8_t *tail, int tailLength, uint8_t *out)
+{
+    uint8_t padded[128] = {0};
+    int blocks = tailLength + 9 <= 64 ? 1 : 2;
+    uint64_t bits = (hashedBytes + tailLength) * 8;
+    uint32_t state[8];
+
+    memcpy(padded, tail, tailLength);
+    padded[tailLength] = 0x80;
+    for (int i = 0; i < 8; i++)
+        padded[blocks * 64 - 1 - i] = bits >> (8 * i);
+
+    memcpy(state, digest, sizeof(state));
+    for (int block = 0; block < blocks; block++)
+    {
+        uint32_t w[16];
+        for (int i = 0; i < 16; i++)
+            w[i] = __builtin_bswap32(*(const uint32_t *)(padded + 64 * block + 4 * i));
+        sha256Compress(state, w);
+    }
+
+    for (int i = 0; i < 8; i++)
+        *(uint32_t *)(out + 4 * i) = __builtin_bswap32(state[i]);
+}
+
+// ChaCha20 block function over Lanes independent states at once, written with
+// GCC vector extensions: each vector holds one state word of every lane, so
+// the rounds are plain vector adds, xors and rotates. The kernels built on it
+// are instantiated inside target-specific wrappers below, which lets the
+// compiler emit AVX-512 or AVX2 code for the same source.
+template <typename Vector>
+static inline __attribute__((always_inline)) void chachaBlock(const Vector input[16], Vector x[16])
+{
+    for (int w = 0; w < 16; w++)
+        x[w] = input[w];
+
+#define QUARTER_ROUND(a, b, c, d)               \
+    x[a] += x[b], x[d] = ROTATE(x[d] ^ x[a], 16); \
+    x[c] += x[d], x[b] = ROTATE(x[b] ^ x[c], 12); \
+    x[a] += x[b], x[d] = ROTATE(x[d] ^ x[a], 8);  \
+    x[c] += x[d], x[b] = ROTATE(x[b] ^ x[c], 7);
+
+    for (int round = 0; round < 10; round++)
+    {
+        QUARTER_ROUND(0, 4, 8, 12)
+        QUARTER_ROUND(1, 5, 9, 13)
+        QUARTER_ROUND(2, 6, 10, 14)
+        QUARTER_ROUND(3, 7, 11, 15)
+        QUARTER_ROUND(0, 5, 10, 15)
+        QUARTER_ROUND(1, 6, 11, 12)
+        QUARTER_ROUND(2, 7, 8, 13)
+        QUARTER_ROUND(3, 4, 9, 14)
+    }
+
+#undef QUARTER_ROUND
+
+    for (int w = 0; w < 16; w++)
+        x[w] += input[w];
+}
+
+// Constant words, keys and counters. OpenSSL carries the 32-bit block counter
+// into the zero nonce, which makes words 12 and 13 a 64-bit counter.
+template <int Lanes, typename Vector>
+static inline __attribute__((always_inline)) void loadChachaInput(Vector input[16], const uint32_t (*keyWords)[BATCH_MAX_LANES], const uint64_t *counters)
+{
+    const Vector zero = {};
+
+    input[0] = zero + 0x61707865u;
+    input[1] = zero + 0x3320646eu;
+    input[2] = zero + 0x79622d32u;
+    input[3] = zero + 0x6b206574u;
+    for (int w = 0; w < 8; w++)
+        memcpy(&input[4 + w], keyWords[w], sizeof(Vector));
+    for (int l = 0; l < Lanes; l++)
+    {
+        input[12][l] = (uint32_t)counters[l];
+        input[13][l] = (uint32_t)(counters[l] >> 32);
+    }
+    input[14] = zero;
+    input[15] = zero;
+}
+
+template <typename Vector>
+static inline __attribute__((always_inline)) void incrementCounter(Vector input[16])
+{
+    input[12] += 1;
+    input[13] += (Vector)(input[12] == 0) & 1;
+}
+
+// Shuffle indices for transposeLanes: stage k swaps blocks of Lanes / 2^(k+1)
+// words, upper for the row with that bit clear, lower for its partner
+template <int Lanes>
+struct TransposeMasks
+{
+    uint32_t upper[4][Lanes];
+    uint32_t lower[4][Lanes];
+
+    constexpr TransposeMasks() : upper(), lower()
+    {
+        for (int k = 0, s = Lanes / 2; s >= 1; k++, s /= 2)
+        {
+            for (int j = 0; j < Lanes; j++)
+            {
+                upper[k][j] = (j & s) ? Lanes + j - s : j;
+                lower[k][j] = (j & s) ? Lanes + j : j + s;
+            }
+        }
+    }
+};
+
+template <int Lanes>
+static constexpr TransposeMasks<Lanes> transposeMasks;
+
+// Turns Lanes rows of Lanes words (row w = word w of every lane) into one row
+// per lane, by swapping off-diagonal blocks of halving size
+template <int Lanes, typename Vector>
+static inline __attribute__((always_inline)) void transposeLanes(Vector *rows)
+{
+#pragma GCC unroll 4
+    for (int k = 0, s = Lanes / 2; s >= 1; k++, s /= 2)
+    {
+        Vector upperMask, lowerMask;
+        memcpy(&upperMask, transposeMasks<Lanes>.upper[k], sizeof(Vector));
+        memcpy(&lowerMask, transposeMasks<Lanes>.lower[k], sizeof(Vector));
+
+#pragma GCC unroll 16
+        for (int i = 0; i < Lanes; i++)
+        {
+            if (i & s)
+                continue;
+
+            Vector upper = __builtin_shuffle(rows[i], rows[i + s], upperMask);
+            rows[i + s] = __builtin_shuffle(rows[i], rows[i + s], lowerMask);
+            rows[i] = upper;
+        }
+    }
+}
+
+// Keystream blocks for every lane, written straight to out[l] + 64 * block;
+// lanes whose out pointer is NULL are computed but not stored
+template <int Lanes>
+static inline __attribute__((always_inline)) void chachaLanes(const uint32_t (*keyWords)[BATCH_MAX_LANES], const uint64_t *counters, uint8_t *const *out, int blocks)
+{
+    typedef typename LaneVector<Lanes>::type Vector;
+
+    Vector input[16];
+    loadChachaInput<Lanes>(input, keyWords, counters);
+
+    for (int block = 0; block < blocks; block++)
+    {
+        Vector x[16];
+        chachaBlock(input, x);
+        incrementCounter(input);
+
+        // 16 / Lanes square groups of words, each becoming a slice of every
+        // lane's block
+        for (int group = 0; group < 16; group += Lanes)
+        {
+            transposeLanes<Lanes>(x + group);
+
+            for (int l = 0; l < Lanes; l++)
+            {
+                if (out[l] != NULL)
+                    memcpy(out[l] + 64 * (size_t)block + 4 * group, &x[group + l], sizeof(Vector));
+            }
+        }
+    }
+}
+
+// Runs the search of every active lane until some lane's previous block may
+// hold the start of its pattern, and returns those lanes as a bit mask. Each
+// step hashes the previous block of the lanes that have one, moves the
+// current block into its place and computes the next one; the candidates are
+// then checked on the first two pattern bytes only, across the whole previous
+// block and into the current one. The caller resolves the candidates and
+// calls again, which first hashes the previous blocks it left in place.
+template <int Lanes>
+static inline __attribute__((always_inline)) uint32_t searchLanes(uint32_t (*keyWords)[BATCH_MAX_LANES], uint64_t *counters, BatchSearchState &state)
+{
+    typedef typename LaneVector<Lanes>::type Vector;
+
+    Vector input[16], digest[8], previous[16], current[16];
+    loadChachaInput<Lanes>(input, keyWords, counters);
+
+    Vector hasPrevious, hasCurrent, active, head, headMask;
+
+    for (int i = 0; i < 8; i++)
+        memcpy(&digest[i], state.digest[i], sizeof(Vector));
+    for (int w = 0; w < 16; w++)
+    {
+        memcpy(&previous[w], state.previous[w], sizeof(Vector));
+        memcpy(&current[w], state.current[w], sizeof(Vector));
+    }
+    memcpy(&hasPrevious, state.hasPrevious, sizeof(Vector));
+    memcpy(&hasCurrent, state.hasCurrent, sizeof(Vector));
+    memcpy(&active, state.active, sizeof(Vector));
+    memcpy(&head, state.patternHead, sizeof(Vector));
+    memcpy(&headMask, state.patternHeadMask, sizeof(Vector));
+
+    // a match at byte 0, 1 or 2 of a word lies within it, one at byte 3
+    // continues in the next word
+    const Vector first = head & 0xff, second = head >> 8, secondMask = headMask >> 8;
+    uint32_t candidates = 0;
+
+    while (candidates == 0)
+    {
+        Vector hashed[8], w[16];
+        for (int i = 0; i < 8; i++)
+            hashed[i] = digest[i];
+        for (int i = 0; i < 16; i++)
+            w[i] = BYTE_SWAP(previous[i]);
+
+        sha256Compress(hashed, w);
+
+        for (int i = 0; i < 8; i++)
+            digest[i] = BLEND(hasPrevious, hashed[i], digest[i]);
+        for (int i = 0; i < 16; i++)
+            previous[i] = current[i];
+        hasPrevious = hasCurrent;
+
+        chachaBlock(input, current);
+        incrementCounter(input);
+        hasCurrent = active;
+
+        Vector found = {};
+        for (int i = 0; i < 16; i++)
+        {
+            Vector v = previous[i], next = i < 15 ? previous[i + 1] : current[0];
+
+            found |= (Vector)(((v ^ head) & headMask) == 0);
+            found |= (Vector)(((v ^ (head << 8)) & (headMask << 8)) == 0);
+            found |= (Vector)(((v ^ (head << 16)) & (headMask << 16)) == 0);
+            found |= (Vector)((v >> 24) == first) & (Vector)(((next ^ second) & secondMask) == 0);
+        }
+
+        found &= hasPrevious;
+        for (int l = 0; l < Lanes; l++)
+            candidates |= (found[l] != 0) << l;
+    }
+
+    for (int l = 0; l < Lanes; l++)
+        counters[l] = input[12][l] | (uint64_t)input[13][l] << 32;
+
+    for (int i = 0; i < 8; i++)
+        memcpy(state.digest[i], &digest[i], sizeof(Vector));
+    for (int w = 0; w < 16; w++)
+    {
+        memcpy(state.previous[w], &previous[w], sizeof(Vector));
+        memcpy(state.current[w], &current[w], sizeof(Vector));
+    }
+    memcpy(state.hasPrevious, &hasPrevious, sizeof(Vector));
+    memcpy(state.hasCurrent, &hasCurrent, sizeof(Vector));
+
+    return candidates;
+}
+
+typedef void (*ChachaKernel)(const uint32_t (*)[BATCH_MAX_LANES], const uint64_t *, uint8_t *const *, int);
+typedef uint32_t (*SearchKernel)(uint32_t (*)[BATCH_MAX_LANES], uint64_t *, BatchSearchState &);
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx512f"))) static void chacha16Avx512(const uint32_t (*keyWords)[BATCH_MAX_LANES], const uint64_t *counters, uint8_t *const *out, int blocks)
+{
+    chachaLanes<16>(keyWords, counters, out, blocks);
+}
+
+__attribute__((target("avx512f"))) static uint32_t search16Avx512(uint32_t (*keyWords)[BATCH_MAX_LANES], uint64_t *counters, BatchSearchState &state)
+{
+    return searchLanes<16>(keyWords, counters, state);
+}
+
+__attribute__((target("avx2"))) static void chacha8Avx2(const uint32_t (*keyWords)[BATCH_MAX_LANES], const uint64_t *counters, uint8_t *const *out, int blocks)
+{
+    chachaLanes<8>(keyWords, counters, out, blocks);
+}
+
+__attribute__((target("avx2"))) static uint32_t search8Avx2(uint32_t (*keyWords)[BATCH_MAX_LANES], uint64_t *counters, BatchSearchState &state)
+{
+    return searchLanes<8>(keyWords, counters, state);
+}
+#endif
+
+static void chacha4Generic(const uint32_t (*keyWords)[BATCH_MAX_LANES], const uint64_t *counters, uint8_t *const *out, int blocks)
+{
+    chachaLanes<4>(keyWords, counters, out, blocks);
+}
+
+static uint32_t search4Generic(uint32_t (*keyWords)[BATCH_MAX_LANES], uint64_t *counters, BatchSearchState &state)
+{
+    return searchLanes<4>(keyWords, counters, state);
+}
+
+struct KernelChoice
+{
+    ChachaKernel kernel;
+    SearchKernel search;
+    int lanes;
+};
+
+static KernelChoice chooseKernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return {chacha16Avx512, search16Avx512, 16};
+    if (__builtin_cpu_supports("avx2"))
+        return {chacha8Avx2, search8Avx2, 8};
+#endif
+    return {chacha4Generic, search4Generic, 4};
+}
+
+static const KernelChoice kernelChoice = chooseKernel();
+
+int GeneratorBatch::lanes()
+{
+    return kernelChoice.lanes;
+}
+
+// With fewer than 16 lanes, OpenSSL's single-stream ChaCha20 is as wide as the
+// lanes and SHA-256 extensions outrun narrow multi-lane hashing, so the batch
+// would be slower than running the generators one by one
+GeneratorBatch::GeneratorBatch(std::vector<Generator> &generators) : generators(generators)
+{
+    this->laneCount = GeneratorBatch::lanes();
+    this->lockstep = this->laneCount == BATCH_MAX_LANES;
+}
+
+void GeneratorBatch::keystreamBlocks(const LaneKeys &keys, uint8_t *out, int blocks)
+{
+    uint8_t *laneOut[BATCH_MAX_LANES] = {};
+
+    for (int l = 0; l < kernelChoice.lanes; l++)
+        laneOut[l] = out + (size_t)l * blocks * 64;
+
+    kernelChoice.kernel(keys.words, keys.counters, laneOut, blocks);
+}
+
+void GeneratorBatch::setLaneKey(LaneKeys &keys, int laneIndex, const Seed &seed, uint64_t counter)
+{
+    for (int w = 0; w < 8; w++)
+        memcpy(&keys.words[w][laneIndex], seed.bytes + 4 * w, sizeof(uint32_t));
+
+    keys.counters[laneIndex] = counter;
+}
+
+void GeneratorBatch::setup()
+{
+    for (const Generator &generator : this->generators)
+        if (!generator.checkpointFile.empty())
+            throw GeneratorException("GeneratorBatch does not support setup checkpoints", GeneratorExceptionTypes::GENERATOR_SETUP_ERROR);
+
+    std::vector<Seed> bootstrapSeeds(this->generators.size());
+
+    if (!this->arena)
+        this->arena = std::make_shared<Argon2Arena>();
+
+    // Argon2 is memory-bound and stays per generator; generators without an
+    // arena of their own share the batch's, which is kept across setup calls
+    for (size_t i = 0; i < this->generators.size(); i++)
+    {
+        Generator &generator = this->generators[i];
+        bool borrowed = !generator.argon2Arena;
+
+        if (borrowed)
+            generator.argon2Arena = this->arena;
+
+        DRSA_PROBE2(setup_start, generator.args.IC, generator.args.patternBytes);
+        generator.findBootstrapSeed(generator.args, bootstrapSeeds[i]);
+        DRSA_PROBE1(bootstrap_done, generator.args.IC);
+
+        if (borrowed)
+            generator.argon2Arena.reset();
+    }
+
+    if (this->lockstep)
+    {
+        searchSeeds(bootstrapSeeds);
+        return;
+    }
+
+    for (size_t i = 0; i < this->generators.size(); i++)
+        searchAlone(this->generators[i], bootstrapSeeds[i]);
+}
+
+// The rest of Generator::setup, after the bootstrap seed
+void GeneratorBatch::searchAlone(Generator &generator, const Seed &bootstrapSeed)
+{
+    Seed seed = bootstrapSeed;
+    Pattern pattern;
+    pattern.size = generator.args.patternBytes;
+    Generator::generatePattern(pattern, generator.args.CS);
+
+    generator.initializeGenerator(seed);
+    for (int i = 0; i < generator.args.IC; i++)
+    {
+        generator.findNextSeedByPattern(pattern, seed);
+        generator.initializeGenerator(seed);
+    }
+
+    generator.setupDone = true;
+    DRSA_PROBE1(setup_done, generator.args.IC);
+}
+
+// Runs the IC pattern-search iterations of every generator, starting each
+// from its bootstrap seed, and leaves each one keyed as after setup()
+void GeneratorBatch::searchSeeds(std::vector<Seed> &bootstrapSeeds)
+{
+    std::vector<SearchLane> lanes(this->laneCount);
+    LaneKeys keys = {};
+    BatchSearchState state = {};
+    size_t nextGenerator = 0;
+    int active = 0;
+
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+    if (md == NULL)
+        throw GeneratorException("Error creating EVP_MD_CTX", GeneratorExceptionTypes::GENERATOR_SETUP_ERROR);
+
+    try
+    {
+        for (int l = 0; l < this->laneCount; l++)
+        {
+            while (lanes[l].generator < 0 && nextGenerator < this->generators.size())
+            {
+                int index = nextGenerator++;
+                startLane(lanes[l], keys, state, l, index, bootstrapSeeds[index]);
+            }
+            active += lanes[l].generator >= 0;
+        }
+
+        while (active > 0)
+        {
+            uint32_t candidates = kernelChoice.search(keys.words, keys.counters, state);
+
+            for (int l = 0; l < this->laneCount; l++)
+            {
+                SearchLane &lane = lanes[l];
+                if ((candidates & (1u << l)) == 0)
+                    continue;
+
+                checkCandidate(lane, keys, state, l, md);
+
+                // refill a lane whose generator finished its last iteration
+                while (lane.generator < 0 && nextGenerator < this->generators.size())
+                {
+                    int index = nextGenerator++;
+                    startLane(lane, keys, state, l, index, bootstrapSeeds[index]);
+                }
+
+                if (lane.generator < 0)
+                {
+                    state.active[l] = 0;
+                    state.hasPrevious[l] = 0;
+                    state.hasCurrent[l] = 0;
+                    active--;
+                }
+            }
+        }
+    }
+    catch (...)
+    {
+        EVP_MD_CTX_free(md);
+        throw;
+    }
+
+    EVP_MD_CTX_free(md);
+}
+
+// Keys the lane with seed from block 0 and an empty hash, and drops the
+// blocks it held for the previous key
+void GeneratorBatch::restartSearch(LaneKeys &keys, BatchSearchState &state, int laneIndex, const Seed &seed)
+{
+    setLaneKey(keys, laneIndex, seed, 0);
+
+    for (int i = 0; i < 8; i++)
+        state.digest[i][laneIndex] = sha256InitialState[i];
+
+    state.hasPrevious[laneIndex] = 0;
+    state.hasCurrent[laneIndex] = 0;
+}
+
+void GeneratorBatch::startLane(SearchLane &lane, LaneKeys &keys, BatchSearchState &state, int laneIndex, int generator, const Seed &seed)
+{
+    Generator &owner = this->generators[generator];
+
+    lane.generator = generator;
+    lane.iteration = 0;
+    lane.pattern.size = owner.args.patternBytes;
+    Generator::generatePattern(lane.pattern, owner.args.CS);
+
+    if (owner.args.IC == 0)
+    {
+        Seed finalSeed = seed;
+        owner.initializeGenerator(finalSeed);
+        owner.setupDone = true;
+        DRSA_PROBE1(setup_done, owner.args.IC);
+        lane.generator = -1;
+        return;
+    }
+
+    bool twoBytes = lane.pattern.size >= 2;
+    state.patternHead[laneIndex] = lane.pattern.bytes[0] | (twoBytes ? lane.pattern.bytes[1] << 8 : 0);
+    state.patternHeadMask[laneIndex] = twoBytes ? 0xffff : 0xff;
+    state.active[laneIndex] = 0xffffffff;
+
+    restartSearch(keys, state, laneIndex, seed);
+}
+
+// Looks for the full pattern in a candidate lane's previous block, exactly as
+// Generator::findNextSeedByPattern would at that point of the keystream. On a
+// match the hash of the prefix is finished, and the lane either starts its
+// next iteration or hands its generator its final key. Blocks generated past
+// the match belong to the old key and are dropped, as the serial search
+// re-keys too.
+void GeneratorBatch::checkCandidate(SearchLane &lane, LaneKeys &keys, BatchSearchState &state, int laneIndex, EVP_MD_CTX *md)
+{
+    uint8_t bytes[128];
+    for (int w = 0; w < 16; w++)
+    {
+        memcpy(bytes + 4 * w, &state.previous[w][laneIndex], sizeof(uint32_t));
+        memcpy(bytes + 64 + 4 * w, &state.current[w][laneIndex], sizeof(uint32_t));
+    }
+
+    const uint8_t *match = Generator::findPattern(bytes, 64, lane.pattern);
+    if (match == NULL)
+        return;
+
+    // the counter points past the current block; the previous one is the
+    // first block not yet hashed
+    uint64_t hashedBytes = (keys.counters[laneIndex] - 2) * 64;
+    uint32_t digest[8];
+    Generator::SHA256Result result;
+    Generator::LeadingPatternBytes leading;
+    Seed seed;
+
+    for (int i = 0; i < 8; i++)
+        digest[i] = state.digest[i][laneIndex];
+
+    sha256Finish(digest, hashedBytes, bytes, match - bytes, result.bytes);
+    memcpy(leading.bytes, match + lane.pattern.size, sizeof(leading.bytes));
+    Generator::calculateSeed(seed, result, leading, md);
+
+    Generator &owner = this->generators[lane.generator];
+    lane.iteration++;
+
+    if (lane.iteration == owner.args.IC)
+    {
+        owner.initializeGenerator(seed);
+        owner.setupDone = true;
+        DRSA_PROBE1(setup_done, owner.args.IC);
+        lane.generator = -1;
+        return;
+    }
+
+    restartSearch(keys, state, laneIndex, seed);
+}
+
+// Bulk output: unaligned heads and tails go through each generator's own
+// cipher, whole 64-byte blocks through the lanes, straight into the output
+// buffers. Each generator's cipher context is then moved to the end of what
+// was produced.
+void GeneratorBatch::nextBlocks(uint8_t *const *blocks, int blockLength)
+{
+    for (Generator &generator : this->generators)
+    {
+        if (!generator.setupDone)
+            throw GeneratorException("Could not call GeneratorBatch::nextBlocks without calling setup()", GeneratorExceptionTypes::GENERATOR_RUNTIME_ERROR);
+    }
+
+    if (!this->lockstep)
+    {
+        for (size_t i = 0; i < this->generators.size(); i++)
+            this->generators[i].nextBlock(blocks[i], blockLength);
+        return;
+    }
+
+    for (size_t first = 0; first < this->generators.size(); first += this->laneCount)
+    {
+        int count = std::min((size_t)this->laneCount, this->generators.size() - first);
+        LaneKeys keys = {};
+        uint8_t *laneOut[BATCH_MAX_LANES] = {};
+        int heads[BATCH_MAX_LANES];
+        int body = blockLength;
+
+        for (int l = 0; l < count; l++)
+        {
+            Generator &generator = this->generators[first + l];
+            heads[l] = std::min((int)((64 - generator.keystreamOffset % 64) % 64), blockLength);
+            generator.seekNextBytesFromGenerator(blocks[first + l], heads[l]);
+
+            setLaneKey(keys, l, generator.key, generator.keystreamOffset / 64);
+            laneOut[l] = blocks[first + l] + heads[l];
+        }
+
+        // heads differ per lane, so the lockstep part covers the whole blocks
+        // every lane still needs
+        for (int l = 0; l < count; l++)
+            body = std::min(body, blockLength - heads[l]);
+        body -= body % 64;
+
+        kernelChoice.kernel(keys.words, keys.counters, laneOut, body / 64);
+
+        for (int l = 0; l < count; l++)
+        {
+            Generator &generator = this->generators[first + l];
+            uint64_t offset = generator.keystreamOffset + body;
+            int tail = blockLength - heads[l] - body;
+
+            generator.keystreamAt(generator.cipher.ctx, offset, blocks[first + l] + heads[l] + body, tail);
+            generator.keystreamOffset = offset + tail;
+        }
+    }
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "generator.h"
+#include <vector>
+
+#define BATCH_MAX_LANES 16
+
+// Vector state of the lockstep pattern search, defined in generatorBatch.cpp
+struct BatchSearchState;
+
+// Advances several independent Generators together, one per SIMD lane of a
+// multi-buffer ChaCha20 and SHA-256 (16 lanes with AVX-512, 8 with AVX2, 4
+// otherwise). Every generator ends up in exactly the state, and produces
+// exactly the bytes, it would have running alone; only the keystream and the
+// prefix hashes are computed in lockstep. Generators needing more setup
+// iterations than others simply keep their lane longer, and a freed lane is
+// refilled with the next generator. Lockstep needs the 16 AVX-512 lanes to
+// beat OpenSSL's own single-stream code; with fewer lanes the batch runs the
+// generators one by one.
+class GeneratorBatch
+{
+
+public:
+    GeneratorBatch(std::vector<Generator> &generators);
+
+    // Equivalent to calling setup() on every generator. Checkpoints are not
+    // supported: a generator with a checkpoint file is rejected with a
+    // GENERATOR_SETUP_ERROR before any work starts
+    void setup();
+
+    // Equivalent to calling nextBlock(blocks[i], blockLength) on generator i
+    void nextBlocks(uint8_t *const *blocks, int blockLength);
+
+    // Number of streams computed per ChaCha20 call on this CPU
+    static int lanes();
+
+protected:
+    using Seed = Generator::Seed;
+    using Pattern = Generator::Pattern;
+
+    // Keys and 64-byte block counters of all lanes, stored word-major so the
+    // kernel loads one vector per state word
+    struct LaneKeys
+    {
+        alignas(64) uint32_t words[8][BATCH_MAX_LANES];
+        uint64_t counters[BATCH_MAX_LANES];
+    };
+
+    // Which generator a lane is searching for, and how far it got
+    struct SearchLane
+    {
+        int generator = -1;
+        uint32_t iteration = 0;
+        Pattern pattern;
+    };
+
+    // Protected so tests can start the search from known seeds
+    void searchSeeds(std::vector<Seed> &bootstrapSeeds);
+
+    void startLane(SearchLane &lane, LaneKeys &keys, BatchSearchState &state, int laneIndex, int generator, const Seed &seed);
+    void checkCandidate(SearchLane &lane, LaneKeys &keys, BatchSearchState &state, int laneIndex, EVP_MD_CTX *md);
+
+    static void setLaneKey(LaneKeys &keys, int laneIndex, const Seed &seed, uint64_t counter);
+    static void restartSearch(LaneKeys &keys, BatchSearchState &state, int laneIndex, const Seed &seed);
+
+    // Lane l's keystream goes to out + l * blocks * 64
+    static void keystreamBlocks(const LaneKeys &keys, uint8_t *out, int blocks);
+
+    // The search of one generator on its own, used when the batch does not
+    // run in lockstep
+    void searchAlone(Generator &generator, const Seed &bootstrapSeed);
+
+    std::vector<Generator> &generators;
+    std::shared_ptr<Argon2Arena> arena;
+    int laneCount;
+    // false when lockstep would be slower than running every generator
+    // alone (see the constructor); tests set it to cover the lanes anyway
+    bool lockstep;
+};
@@ -7,7 +7,7 @@ enum GeneratorExceptionTypes {
     GENERATOR_RUNTIME_ERROR
 };
 
-std::string generatorExceptionTypesRepr(GeneratorExceptionTypes type) {
+inline std::string generatorExceptionTypesRepr(GeneratorExceptionTypes type) {
     switch(type) {
         case GENERATOR_SETUP_ERROR: return "Generator Setup Error";
         case GENERATOR_RUNTIME_ERROR: return "Generator Runtime Error";
@@ -18,10 +18,18 @@ std::string generatorExceptionTypesRepr(GeneratorExceptionTypes type) {
 
 class GeneratorException : public std::exception {
     public:
-        GeneratorException(const std::string& message, GeneratorExceptionTypes type) : message(message) {}
+        GeneratorException(const std::string& message, GeneratorExceptionTypes type)
+            : type(type)
+        {
+            // appended piecewise: GCC 12 reports a bogus -Wrestrict for the
+            // equivalent chain of operator+ in C++20 mode
+            std::string repr = generatorExceptionTypesRepr(type);
+            this->message.reserve(repr.size() + message.size() + 3);
+            this->message.append("(").append(repr).append(")\n").append(message);
+        }
 
         const char* what() const noexcept override {
-            return ("(" + generatorExceptionTypesRepr(this->type) + ")\n" + message).c_str(); 
+            return message.c_str();
         }
 
     private:
@@ -0,0 +1,138 @@
+#include "generatorSampler.h"
+#include "generatorException.h"
+#include <cstring>
+#include <algorithm>
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "samples are read as little-endian words");
+
+GeneratorSampler::GeneratorSampler(Generator &generator) : generator(generator)
+{
+}
+
+size_t GeneratorSampler::available(size_t wordSize)
+{
+    size_t remaining = SAMPLER_BUFFER_SIZE - this->position;
+
+    if (remaining < wordSize)
+    {
+        // keep a partial word and continue it with fresh keystream
+        memmove(this->buffer, this->buffer + this->position, remaining);
+        this->generator.nextBlock(this->buffer + remaining, SAMPLER_BUFFER_SIZE - remaining);
+        this->position = 0;
+        remaining = SAMPLER_BUFFER_SIZE;
+    }
+
+    return remaining / wordSize;
+}
+
+template <typename Word>
+void GeneratorSampler::fillWords(Word *out, size_t count)
+{
+    while (count > 0)
+    {
+        size_t words = std::min(available(sizeof(Word)), count);
+
+        memcpy(out, this->buffer + this->position, words * sizeof(Word));
+        this->position += words * sizeof(Word);
+        out += words;
+        count -= words;
+    }
+}
+
+// Lemire's nearly divisionless method, batched: a first pass computes the
+// products of a run of candidates (a plain loop the compiler vectorizes), a
+// second one keeps the accepted ones in order without branching. Each run
+// is at most as long as the number of samples still missing, so no
+// candidate past the last accepted one is consumed.
+template <typename Word, typename Wide>
+void GeneratorSampler::fillUniform(Word *out, size_t count, Word range)
+{
+    if (range == 0)
+        throw GeneratorException("Sampling range must not be zero", GeneratorExceptionTypes::GENERATOR_RUNTIME_ERROR);
+
+    const Word threshold = (Word)(-range) % range;
+    const int bits = sizeof(Word) * 8;
+
+    Word candidates[SAMPLER_BATCH_SIZE];
+    Word high[SAMPLER_BATCH_SIZE];
+    Word low[SAMPLER_BATCH_SIZE];
+
+    while (count > 0)
+    {
+        size_t run = std::min({available(sizeof(Word)), count, (size_t)SAMPLER_BATCH_SIZE});
+
+        memcpy(candidates, this->buffer + this->position, run * sizeof(Word));
+        this->position += run * sizeof(Word);
+
+        for (size_t i = 0; i < run; i++)
+        {
+            Wide product = (Wide)candidates[i] * range;
+            high[i] = (Word)(product >> bits);
+            low[i] = (Word)product;
+        }
+
+        size_t accepted = 0;
+        for (size_t i = 0; i < run; i++)
+        {
+            out[accepted] = high[i];
+            accepted += low[i] >= threshold;
+        }
+
+        out += accepted;
+        count -= accepted;
+    }
+}
+
+void GeneratorSampler::fillUint32(uint32_t *out, size_t count)
+{
+    fillWords(out, count);
+}
+
+void GeneratorSampler::fillUint64(uint64_t *out, size_t count)
+{
+    fillWords(out, count);
+}
+
+void GeneratorSampler::fillUniform32(uint32_t *out, size_t count, uint32_t range)
+{
+    fillUniform<uint32_t, uint64_t>(out, count, range);
+}
+
+void GeneratorSampler::fillUniform64(uint64_t *out, size_t count, uint64_t range)
+{
+    fillUniform<uint64_t, unsigned __int128>(out, count, range);
+}
+
+void GeneratorSampler::fillUnitFloat(float *out, size_t count)
+{
+    uint32_t words[SAMPLER_BATCH_SIZE];
+
+    while (count > 0)
+    {
+        size_t run = std::min(count, (size_t)SAMPLER_BATCH_SIZE);
+
+        fillWords(words, run);
+        for (size_t i = 0; i < run; i++)
+            out[i] = (words[i] >> 8) * 0x1.0p-24f;
+
+        out += run;
+        count -= run;
+    }
+}
+
+void GeneratorSampler::fillUnitDouble(double *out, size_t count)
+{
+    uint64_t words[SAMPLER_BATCH_SIZE];
+
+    while (count > 0)
+    {
+        size_t run = std::min(count, (size_t)SAMPLER_BATCH_SIZE);
+
+        fillWords(words, run);
+        for (size_t i = 0; i < run; i++)
+            out[i] = (words[i] >> 11) * 0x1.0p-53;
+
+        out += run;
+        count -= run;
+    }
+}
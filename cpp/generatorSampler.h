@@ -0,0 +1,56 @@
+#pragma once
+
+#include "generator.h"
+#include <cstddef>
+#include <cstdint>
+
+#define SAMPLER_BUFFER_SIZE (16 * 1024)
+#define SAMPLER_BATCH_SIZE 256
+
+// Typed samples drawn from a set-up Generator, produced a whole array per
+// call on top of a buffered keystream. The values only depend on the
+// keystream, so any implementation reading the same bytes gets the same
+// samples:
+//
+//  - every sample consumes the next unused keystream bytes, in order;
+//  - uint32 / uint64 are 4 / 8 bytes, little endian;
+//  - uniform32(range) is Lemire's method on uint32 x: m = x * range (64
+//    bits); x is rejected while (uint32)m < (2^32 - range) % range, and the
+//    sample is m >> 32. uniform64 is the same with uint64 and 128-bit m;
+//  - unitFloat is (uint32 >> 8) * 2^-24 and unitDouble is
+//    (uint64 >> 11) * 2^-53, both in [0, 1).
+//
+// The sampler buffers ahead, so the generator must not be read directly
+// while a sampler is in use.
+class GeneratorSampler
+{
+
+public:
+    GeneratorSampler(Generator &generator);
+
+    void fillUint32(uint32_t *out, size_t count);
+    void fillUint64(uint64_t *out, size_t count);
+
+    // Uniform integers in [0, range); range must not be zero
+    void fillUniform32(uint32_t *out, size_t count, uint32_t range);
+    void fillUniform64(uint64_t *out, size_t count, uint64_t range);
+
+    // Uniform floating-point values in [0, 1)
+    void fillUnitFloat(float *out, size_t count);
+    void fillUnitDouble(double *out, size_t count);
+
+protected:
+    // Makes at least one word of wordSize bytes available and returns how
+    // many whole words are buffered
+    size_t available(size_t wordSize);
+
+    template <typename Word>
+    void fillWords(Word *out, size_t count);
+
+    template <typename Word, typename Wide>
+    void fillUniform(Word *out, size_t count, Word range);
+
+    Generator &generator;
+    alignas(64) uint8_t buffer[SAMPLER_BUFFER_SIZE];
+    size_t position = SAMPLER_BUFFER_SIZE;
+};
@@ -0,0 +1,236 @@
+#include "metrics.h"
+#include <csignal>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <pthread.h>
+
+static double seconds(Metrics::Clock::duration d)
+{
+    return std::chrono::duration<double>(d).count();
+}
+
+static double seconds(Metrics::Clock::rep ticks)
+{
+    return seconds(Metrics::Clock::duration(ticks));
+}
+
+Metrics::Metrics(std::optional<std::string> metricsFile)
+{
+    this->metricsFile = metricsFile;
+    this->startTime = Clock::now();
+    this->lastRateTime = this->startTime;
+    this->reporter = std::thread(&Metrics::report, this);
+}
+
+Metrics::~Metrics()
+{
+    this->stopReporter();
+}
+
+void Metrics::blockSnapshotSignal()
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+}
+
+void Metrics::startOutput()
+{
+    this->outputStart = Clock::now().time_since_epoch().count();
+}
+
+void Metrics::finish()
+{
+    if (!this->reporter.joinable())
+        return;
+
+    this->stopReporter();
+
+    // close the current rate interval early so the last sample is not lost
+    Clock::time_point now = Clock::now();
+    this->updateRate(now);
+
+    if (this->metricsFile.has_value())
+        this->writeTextfile(now);
+}
+
+void Metrics::stopReporter()
+{
+    if (this->reporter.joinable())
+    {
+        this->stopping = true;
+        pthread_kill(this->reporter.native_handle(), SIGUSR1);
+        this->reporter.join();
+    }
+}
+
+// Reporter thread: waits for SIGUSR1 or the next flush; finish() wakes it
+// with SIGUSR1 too, after setting stopping
+void Metrics::report()
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+
+    Clock::time_point nextFlush = Clock::now() + std::chrono::milliseconds(METRICS_FLUSH_INTERVAL_MS);
+
+    while (!this->stopping)
+    {
+        Clock::duration wait = std::max(nextFlush - Clock::now(), Clock::duration::zero());
+        std::chrono::seconds whole = std::chrono::duration_cast<std::chrono::seconds>(wait);
+        struct timespec timeout = {(time_t)whole.count(), (long)std::chrono::nanoseconds(wait - whole).count()};
+
+        int signal = sigtimedwait(&set, nullptr, &timeout);
+        if (this->stopping)
+            break;
+
+        Clock::time_point now = Clock::now();
+
+        // stdio rather than std::cerr: cerr flushes the tied std::cout first,
+        // which waits for the output loop's blocked write
+        if (signal == SIGUSR1)
+            fputs(this->snapshot(now).c_str(), stderr);
+
+        if (now >= nextFlush)
+        {
+            this->updateRate(now);
+            nextFlush = now + std::chrono::milliseconds(METRICS_FLUSH_INTERVAL_MS);
+
+            if (this->metricsFile.has_value())
+                this->writeTextfile(now);
+        }
+    }
+}
+
+void Metrics::updateRate(Clock::time_point now)
+{
+    uint64_t bytes = this->bytesWritten;
+    double elapsed = seconds(now - this->lastRateTime);
+
+    if (elapsed > 0)
+        this->rate = (bytes - this->lastRateBytes) / elapsed;
+
+    this->lastRateBytes = bytes;
+    this->lastRateTime = now;
+}
+
+// Total write time including the write in progress, and how long that one
+// has been blocked
+void Metrics::readWriteTime(Clock::time_point now, Clock::duration &total, Clock::duration &blocked) const
+{
+    uint64_t sequence;
+    Clock::rep start, time;
+
+    do
+    {
+        sequence = this->writeSequence;
+        start = this->writeStart;
+        time = this->writeTime;
+    } while ((sequence & 1) != 0 || sequence != this->writeSequence);
+
+    // a write may have started after now was read
+    blocked = start != 0 ? std::max(now - Clock::time_point(Clock::duration(start)), Clock::duration::zero())
+                         : Clock::duration::zero();
+    total = Clock::duration(time) + blocked;
+}
+
+std::string Metrics::snapshot(Clock::time_point now) const
+{
+    std::ostringstream out;
+    Clock::rep outputStart = this->outputStart;
+
+    if (outputStart == 0)
+    {
+        out << "RBG metrics: setup running for " << seconds(now - this->startTime) << " s\n";
+        return out.str();
+    }
+
+    double uptime = seconds(now - Clock::time_point(Clock::duration(outputStart)));
+    uint64_t bytes = this->bytesWritten;
+    Clock::duration writing, blocked;
+    this->readWriteTime(now, writing, blocked);
+
+    out << "RBG metrics: "
+        << bytes << " bytes in " << uptime << " s, "
+        << this->rate << " B/s recent, "
+        << (uptime > 0 ? bytes / uptime : 0) << " B/s average, "
+        << seconds(this->generateTime) << " s generating, "
+        << seconds(this->encodeTime) << " s encoding, "
+        << seconds(writing) << " s blocked in write";
+
+    if (blocked > Clock::duration::zero())
+        out << " (current write blocked for " << seconds(blocked) << " s)";
+
+    out << "\n";
+    return out.str();
+}
+
+// Prometheus textfile format, written next to the target and renamed over
+// it so collectors never observe a partially written file
+void Metrics::writeTextfile(Clock::time_point now)
+{
+    std::ostringstream text;
+    Clock::rep outputStart = this->outputStart;
+    Clock::duration writing, blocked;
+    this->readWriteTime(now, writing, blocked);
+    double uptime = outputStart != 0 ? seconds(now - Clock::time_point(Clock::duration(outputStart))) : 0;
+    double setup = seconds((outputStart != 0 ? Clock::time_point(Clock::duration(outputStart)) : now) - this->startTime);
+
+    text << "# HELP drsa_rbg_bytes_written_total Bytes written to stdout.\n"
+         << "# TYPE drsa_rbg_bytes_written_total counter\n"
+         << "drsa_rbg_bytes_written_total " << this->bytesWritten << "\n"
+         << "# HELP drsa_rbg_bytes_per_second Output rate over the last flush interval.\n"
+         << "# TYPE drsa_rbg_bytes_per_second gauge\n"
+         << "drsa_rbg_bytes_per_second " << this->rate << "\n"
+         << "# HELP drsa_rbg_generate_seconds_total Time spent producing keystream.\n"
+         << "# TYPE drsa_rbg_generate_seconds_total counter\n"
+         << "drsa_rbg_generate_seconds_total " << seconds(this->generateTime) << "\n"
+         << "# HELP drsa_rbg_encode_seconds_total Time spent encoding output (--format).\n"
+         << "# TYPE drsa_rbg_encode_seconds_total counter\n"
+         << "drsa_rbg_encode_seconds_total " << seconds(this->encodeTime) << "\n"
+         << "# HELP drsa_rbg_write_seconds_total Time spent blocked writing to stdout.\n"
+         << "# TYPE drsa_rbg_write_seconds_total counter\n"
+         << "drsa_rbg_write_seconds_total " << seconds(writing) << "\n"
+         << "# HELP drsa_rbg_write_blocked_seconds Duration of the write in progress, 0 when not writing.\n"
+         << "# TYPE drsa_rbg_write_blocked_seconds gauge\n"
+         << "drsa_rbg_write_blocked_seconds " << seconds(blocked) << "\n"
+         << "# HELP drsa_rbg_setup_seconds Time spent in the generator setup so far.\n"
+         << "# TYPE drsa_rbg_setup_seconds gauge\n"
+         << "drsa_rbg_setup_seconds " << setup << "\n"
+         << "# HELP drsa_rbg_uptime_seconds Time since output started.\n"
+         << "# TYPE drsa_rbg_uptime_seconds gauge\n"
+         << "drsa_rbg_uptime_seconds " << uptime << "\n";
+
+    std::string content = text.str();
+    std::string tmpPath = this->metricsFile.value() + ".tmp";
+    bool ok = false;
+    int error = 0;
+
+    FILE *fp = fopen(tmpPath.c_str(), "w");
+    if (fp != nullptr)
+    {
+        ok = fwrite(content.data(), 1, content.size(), fp) == content.size();
+        ok = (fclose(fp) == 0) && ok;
+        ok = ok && rename(tmpPath.c_str(), this->metricsFile.value().c_str()) == 0;
+        error = errno;
+
+        if (!ok)
+            remove(tmpPath.c_str());
+    }
+    else
+    {
+        error = errno;
+    }
+
+    // report once when writes start failing, and again when they recover
+    if (!ok && !this->textfileFailing)
+        fprintf(stderr, "RBG metrics: unable to write %s: %s\n", this->metricsFile.value().c_str(), strerror(error));
+    else if (ok && this->textfileFailing)
+        fprintf(stderr, "RBG metrics: writing %s again\n", this->metricsFile.value().c_str());
+
+    this->textfileFailing = !ok;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <thread>
+
+#define METRICS_FLUSH_INTERVAL_MS 1000
+
+// Throughput and backpressure counters for RBG's output loop.
+// The output loop only updates atomic counters; a reporter thread rewrites
+// the textfile every METRICS_FLUSH_INTERVAL_MS and prints a snapshot on
+// SIGUSR1, so both keep working while the loop is blocked in a write to a
+// stalled consumer, or still inside the generator setup.
+class Metrics
+{
+
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Starts the reporter thread; blockSnapshotSignal must have run first
+    Metrics(std::optional<std::string> metricsFile);
+    ~Metrics();
+
+    Metrics(const Metrics &) = delete;
+    Metrics &operator=(const Metrics &) = delete;
+
+    // Blocks SIGUSR1 in the calling thread and in every thread created after
+    // it, so the reporter thread receives it synchronously. Call it at the
+    // start of main, before anything starts threads.
+    static void blockSnapshotSignal();
+
+    // Setup is over: uptime and rates count from here
+    void startOutput();
+
+    inline void recordGenerate(Clock::duration elapsed) { generateTime += elapsed.count(); }
+    inline void recordEncode(Clock::duration elapsed) { encodeTime += elapsed.count(); }
+
+    // Bracket each write, so a write blocked right now is visible too. Only
+    // the output loop calls these; writeSequence is odd while they update
+    // writeStart and writeTime, so the reporter never counts a finished write
+    // twice or not at all, and the write time it reports never decreases
+    inline void beginWrite()
+    {
+        writeSequence++;
+        writeStart = Clock::now().time_since_epoch().count();
+        writeSequence++;
+    }
+
+    inline void endWrite(uint64_t bytes)
+    {
+        writeSequence++;
+        writeTime += Clock::now().time_since_epoch().count() - writeStart;
+        writeStart = 0;
+        writeSequence++;
+        bytesWritten += bytes;
+    }
+
+    // Stops the reporter after a final textfile update (e.g. when --limit is
+    // reached)
+    void finish();
+
+    std::string snapshot(Clock::time_point now) const;
+
+protected:
+    void report();
+    void stopReporter();
+    void updateRate(Clock::time_point now);
+    void writeTextfile(Clock::time_point now);
+    // now must be read before the call, see beginWrite
+    void readWriteTime(Clock::time_point now, Clock::duration &total, Clock::duration &blocked) const;
+
+    std::optional<std::string> metricsFile;
+    Clock::time_point startTime;
+    std::atomic<Clock::rep> outputStart{0};
+
+    // Clock ticks, 0 in writeStart when no write is in progress
+    std::atomic<Clock::rep> generateTime{0};
+    std::atomic<Clock::rep> encodeTime{0};
+    std::atomic<Clock::rep> writeTime{0};
+    std::atomic<Clock::rep> writeStart{0};
+    std::atomic<uint64_t> writeSequence{0};
+    std::atomic<uint64_t> bytesWritten{0};
+
+    // reporter thread state
+    Clock::time_point lastRateTime;
+    uint64_t lastRateBytes = 0;
+    double rate = 0;
+    bool textfileFailing = false;
+    std::atomic<bool> stopping{false};
+    std::thread reporter;
+};
@@ -0,0 +1,215 @@
+#include "outputEncoder.h"
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define OUTPUT_ENCODER_AVX2
+#endif
+
+static const char *hexDigits = "0123456789abcdef";
+static const char *base64Alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char *base64UrlAlphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+// Both kernels return how many input bytes they consumed; base64 kernels
+// only take whole 3-byte groups
+typedef size_t (*HexKernel)(const uint8_t *, size_t, uint8_t *);
+typedef size_t (*Base64Kernel)(const uint8_t *, size_t, uint8_t *, const char *);
+
+
+static size_t hexScalar(const uint8_t *in, size_t length, uint8_t *out)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        out[2 * i] = hexDigits[in[i] >> 4];
+        out[2 * i + 1] = hexDigits[in[i] & 0x0f];
+    }
+
+    return length;
+}
+
+static size_t base64Scalar(const uint8_t *in, size_t length, uint8_t *out, const char *alphabet)
+{
+    size_t i = 0;
+
+    for (; i + 3 <= length; i += 3, out += 4)
+    {
+        uint32_t group = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+
+        out[0] = alphabet[group >> 18];
+        out[1] = alphabet[(group >> 12) & 0x3f];
+        out[2] = alphabet[(group >> 6) & 0x3f];
+        out[3] = alphabet[group & 0x3f];
+    }
+
+    return i;
+}
+
+
+#ifdef OUTPUT_ENCODER_AVX2
+
+// 32 input bytes per step: split into nibbles, interleave them back into
+// byte order and map each nibble to its digit with a byte shuffle
+__attribute__((target("avx2"))) static size_t hexAvx2(const uint8_t *in, size_t length, uint8_t *out)
+{
+    const __m256i digits = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hexDigits));
+    const __m256i lowNibble = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i high = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), lowNibble);
+        __m256i low = _mm256_and_si256(bytes, lowNibble);
+
+        // unpack works per 128-bit lane: first holds bytes 0-7 | 16-23, second 8-15 | 24-31
+        __m256i first = _mm256_unpacklo_epi8(high, low);
+        __m256i second = _mm256_unpackhi_epi8(high, low);
+
+        __m256i out0 = _mm256_permute2x128_si256(first, second, 0x20);
+        __m256i out1 = _mm256_permute2x128_si256(first, second, 0x31);
+
+        _mm256_storeu_si256((__m256i *)(out + 2 * i), _mm256_shuffle_epi8(digits, out0));
+        _mm256_storeu_si256((__m256i *)(out + 2 * i + 32), _mm256_shuffle_epi8(digits, out1));
+    }
+
+    return i + hexScalar(in + i, length - i, out + 2 * i);
+}
+
+// 24 input bytes per step (12 per 128-bit lane), following Muła and Lemire,
+// "Faster Base64 Encoding and Decoding Using AVX2 Instructions": shuffle the
+// 3-byte groups into 32-bit words, pull the four 6-bit indices into separate
+// bytes with multiplies, then turn indices into characters by adding a
+// per-range offset looked up with a byte shuffle.
+__attribute__((target("avx2"))) static size_t base64Avx2(const uint8_t *in, size_t length, uint8_t *out, const char *alphabet)
+{
+    const __m256i groupShuffle = _mm256_setr_epi8(
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+
+    // offsets per range: 0 for a-z, 1-10 for digits, 11 and 12 for the two
+    // alphabet specific characters, 13 for A-Z
+    const char plus = alphabet[62], slash = alphabet[63];
+    const __m256i offsets = _mm256_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, plus - 62, slash - 63, 'A', 0, 0,
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, plus - 62, slash - 63, 'A', 0, 0);
+
+    size_t i = 0;
+
+    // each 16-byte load only uses 12 bytes, so keep 4 bytes of slack
+    for (; i + 28 <= length; i += 24, out += 32)
+    {
+        __m256i bytes = _mm256_set_m128i(_mm_loadu_si128((const __m128i *)(in + i + 12)),
+                                         _mm_loadu_si128((const __m128i *)(in + i)));
+        bytes = _mm256_shuffle_epi8(bytes, groupShuffle);
+
+        __m256i upper = _mm256_mulhi_epu16(_mm256_and_si256(bytes, _mm256_set1_epi32(0x0fc0fc00)),
+                                           _mm256_set1_epi32(0x04000040));
+        __m256i lower = _mm256_mullo_epi16(_mm256_and_si256(bytes, _mm256_set1_epi32(0x003f03f0)),
+                                           _mm256_set1_epi32(0x01000010));
+        __m256i indices = _mm256_or_si256(upper, lower);
+
+        __m256i range = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        __m256i upperCase = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        range = _mm256_or_si256(range, _mm256_and_si256(upperCase, _mm256_set1_epi8(13)));
+
+        _mm256_storeu_si256((__m256i *)out, _mm256_add_epi8(indices, _mm256_shuffle_epi8(offsets, range)));
+    }
+
+    return i + base64Scalar(in + i, length - i, out, alphabet);
+}
+
+
+static bool hasAvx2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+static const HexKernel hexKernel = hasAvx2() ? hexAvx2 : hexScalar;
+static const Base64Kernel base64Kernel = hasAvx2() ? base64Avx2 : base64Scalar;
+
+#else
+
+static const HexKernel hexKernel = hexScalar;
+static const Base64Kernel base64Kernel = base64Scalar;
+
+#endif
+
+
+OutputEncoder::OutputEncoder(OutputFormat format)
+{
+    this->format = format;
+    this->alphabet = format == OutputFormat::BASE64URL ? base64UrlAlphabet : base64Alphabet;
+    this->pendingLength = 0;
+}
+
+OutputFormat OutputEncoder::parseFormat(const char *name)
+{
+    if (strcmp(name, "raw") == 0)
+        return OutputFormat::RAW;
+    if (strcmp(name, "hex") == 0)
+        return OutputFormat::HEX;
+    if (strcmp(name, "base64") == 0)
+        return OutputFormat::BASE64;
+    if (strcmp(name, "base64url") == 0)
+        return OutputFormat::BASE64URL;
+
+    throw std::invalid_argument("Invalid format value");
+}
+
+size_t OutputEncoder::maxEncodedLength(size_t length) const
+{
+    switch (this->format)
+    {
+    case OutputFormat::HEX:
+        return 2 * length;
+    case OutputFormat::BASE64:
+    case OutputFormat::BASE64URL:
+        // up to two bytes may be left over from the previous call
+        return (length + 2) / 3 * 4;
+    default:
+        return length;
+    }
+}
+
+size_t OutputEncoder::encode(const uint8_t *in, size_t length, uint8_t *out)
+{
+    if (this->format == OutputFormat::RAW)
+    {
+        memcpy(out, in, length);
+        return length;
+    }
+
+    if (this->format == OutputFormat::HEX)
+        return 2 * hexKernel(in, length, out);
+
+    size_t written = 0;
+
+    // complete the group left over from the previous call
+    if (this->pendingLength > 0)
+    {
+        while (this->pendingLength < 3 && length > 0)
+        {
+            this->pending[this->pendingLength++] = *in++;
+            length--;
+        }
+
+        if (this->pendingLength < 3)
+            return 0;
+
+        base64Scalar(this->pending, 3, out, this->alphabet);
+        this->pendingLength = 0;
+        written = 4;
+    }
+
+    size_t consumed = base64Kernel(in, length, out + written, this->alphabet);
+    written += consumed / 3 * 4;
+
+    this->pendingLength = length - consumed;
+    memcpy(this->pending, in + consumed, this->pendingLength);
+
+    return written;
+}
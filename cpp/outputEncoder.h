@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+enum class OutputFormat
+{
+    RAW,
+    HEX,
+    BASE64,
+    BASE64URL
+};
+
+// Text encoding of the RBG output stream. Lowercase hex, or base64 (RFC 4648
+// standard / URL-safe alphabet) without line breaks or padding: the output
+// is a prefix of the encoding of an endless keystream, so the stream can be
+// cut at any byte. Base64 keeps the last one or two bytes of a call that do
+// not fill a 3-byte group and encodes them with the next call, so chunk
+// sizes never change the output. Encoding runs on AVX2 when the CPU has it.
+class OutputEncoder
+{
+
+public:
+    OutputEncoder(OutputFormat format);
+
+    // "raw", "hex", "base64" or "base64url"; throws std::invalid_argument
+    static OutputFormat parseFormat(const char *name);
+
+    // Largest output encode() can produce from length input bytes
+    size_t maxEncodedLength(size_t length) const;
+
+    // Encodes in into out and returns the number of characters written
+    size_t encode(const uint8_t *in, size_t length, uint8_t *out);
+
+protected:
+    OutputFormat format;
+    const char *alphabet;
+
+    uint8_t pending[3];
+    size_t pendingLength;
+};
@@ -0,0 +1,47 @@
+#pragma once
+
+// USDT probes under the "drsa" provider, for bpftrace / perf / systemtap:
+//
+//   bpftrace -e 'usdt:./RBG:drsa:pattern_match { @scan = hist(arg0); }'
+//
+// A probe site compiles to a single nop plus an ELF note, so an untraced
+// run pays nothing. Without <sys/sdt.h> (systemtap-sdt-dev) at build time
+// the probes compile to nothing, unless DRSA_REQUIRE_USDT is defined
+// (make USDT=1), which makes the missing header a build error. Probe
+// arguments must not have side effects, so a probe site stays pure
+// observation whichever way it is built.
+//
+//   Generator and GeneratorBatch (one of each per generator in the batch):
+//     setup_start(IC, patternBytes)     before the Argon2 bootstrap seed
+//     bootstrap_done(IC)                Argon2 finished, pattern search starts
+//     checkpoint_resume(iteration)      setup continues from a saved checkpoint
+//     pattern_match(scanLength, patternBytes)
+//                                       keystream bytes scanned before a match;
+//                                       not fired by the lockstep batch search
+//     generator_init(generator)         (re)keying of a generator's cipher
+//     setup_done(IC)
+//   rsagen:
+//     prime_candidate(bits, count)      before each primality test, count
+//                                       candidates tested so far, this one
+//                                       included
+//     prime_found(bits, count)
+//     keygen_retry(attempt)             key rejected because gcd(e, λ(n)) != 1
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define DRSA_PROBE_ENABLED 1
+#endif
+#endif
+
+#if defined(DRSA_REQUIRE_USDT) && !defined(DRSA_PROBE_ENABLED)
+#error "DRSA_REQUIRE_USDT is set but <sys/sdt.h> was not found; install systemtap-sdt-dev"
+#endif
+
+#ifdef DRSA_PROBE_ENABLED
+#define DRSA_PROBE1(name, a) DTRACE_PROBE1(drsa, name, a)
+#define DRSA_PROBE2(name, a, b) DTRACE_PROBE2(drsa, name, a, b)
+#else
+#define DRSA_PROBE1(name, a) ((void)(a))
+#define DRSA_PROBE2(name, a, b) ((void)(a), (void)(b))
+#endif
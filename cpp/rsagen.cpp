@@ -6,6 +6,7 @@
 #include <fstream>
 #include <cstring>
 #include <stdexcept>
+#include "probes.h"
 
 struct keyInfo
 {
@@ -29,6 +30,7 @@ BIGNUM *genPrime(int valSize, BN_CTX *bnCtx)
 
     unsigned char buffer[valSize / 8];
     int isPrime = 0;
+    long candidates = 0;
 
     std::cin.read(reinterpret_cast<char *>(buffer), valSize / 8);
 
@@ -45,9 +47,13 @@ BIGNUM *genPrime(int valSize, BN_CTX *bnCtx)
     while (!isPrime)
     {
         BN_add(value, value, two);
+        candidates++;
+        DRSA_PROBE2(prime_candidate, valSize, candidates);
         isPrime = BN_is_prime_fasttest(value, 128, NULL, bnCtx, NULL, 1);   
     }
 
+    DRSA_PROBE2(prime_found, valSize, candidates);
+
     BN_free(two);
 
     return value;
@@ -180,6 +186,7 @@ int main(int argc, char const *argv[])
 
     // generate key-pair
     keyInfo keyPair;
+    int attempt = 0;
     while(1)
     {
         try
@@ -188,6 +195,8 @@ int main(int argc, char const *argv[])
             break;
         } catch(std::logic_error& e)
         {
+            attempt++;
+            DRSA_PROBE1(keygen_retry, attempt);
             continue;
         }
     }
@@ -0,0 +1,126 @@
+#include "setupCheckpoint.h"
+#include "generatorException.h"
+#include <cstdio>
+#include <cstring>
+#include <libgen.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define CHECKPOINT_FILE_SIZE (CHECKPOINT_HEADER_SIZE + crypto_aead_xchacha20poly1305_ietf_NPUBBYTES + \
+                              CHECKPOINT_PLAINTEXT_SIZE + crypto_aead_xchacha20poly1305_ietf_ABYTES)
+
+static void storeUint32(uint8_t *out, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        out[i] = value >> (8 * i);
+}
+
+static uint32_t loadUint32(const uint8_t *in)
+{
+    return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+SetupCheckpoint::SetupCheckpoint(const std::string &path, const GeneratorArgs &args, const uint8_t *bootstrapSeed)
+{
+    this->path = path;
+
+    memcpy(this->header, CHECKPOINT_MAGIC, 8);
+    storeUint32(this->header + 8, args.IC);
+    storeUint32(this->header + 12, args.patternBytes);
+
+    static_assert(crypto_kdf_KEYBYTES == 32, "the bootstrap seed is used as the KDF master key");
+    crypto_kdf_derive_from_key(this->key, sizeof(this->key), 1, "DRSAckpt", bootstrapSeed);
+}
+
+SetupCheckpoint::~SetupCheckpoint()
+{
+    sodium_memzero(this->key, sizeof(this->key));
+}
+
+bool SetupCheckpoint::load(uint32_t &iteration, uint8_t *seed) const
+{
+    uint8_t file[CHECKPOINT_FILE_SIZE + 1];
+    uint8_t plaintext[CHECKPOINT_PLAINTEXT_SIZE];
+
+    FILE *fp = fopen(this->path.c_str(), "rb");
+    if (fp == nullptr)
+        return false;
+
+    size_t length = fread(file, 1, sizeof(file), fp);
+    fclose(fp);
+
+    if (length != CHECKPOINT_FILE_SIZE || memcmp(file, this->header, CHECKPOINT_HEADER_SIZE) != 0)
+        return false;
+
+    const uint8_t *nonce = file + CHECKPOINT_HEADER_SIZE;
+    const uint8_t *sealed = nonce + crypto_aead_xchacha20poly1305_ietf_NPUBBYTES;
+
+    if (crypto_aead_xchacha20poly1305_ietf_decrypt(plaintext, NULL, NULL, sealed, CHECKPOINT_FILE_SIZE - (sealed - file),
+                                                   this->header, CHECKPOINT_HEADER_SIZE, nonce, this->key) != 0)
+        return false;
+
+    bool valid = loadUint32(plaintext) <= loadUint32(this->header + 8);
+    if (valid)
+    {
+        iteration = loadUint32(plaintext);
+        memcpy(seed, plaintext + 4, 32);
+    }
+
+    sodium_memzero(plaintext, sizeof(plaintext));
+    return valid;
+}
+
+// The rename is only durable once the directory entry is on disk too
+static bool syncDirectory(const std::string &path)
+{
+    std::string copy = path;
+    int fd = open(dirname(copy.data()), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return false;
+
+    bool ok = fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    return ok;
+}
+
+void SetupCheckpoint::save(uint32_t iteration, const uint8_t *seed) const
+{
+    uint8_t file[CHECKPOINT_FILE_SIZE];
+    uint8_t plaintext[CHECKPOINT_PLAINTEXT_SIZE];
+
+    uint8_t *nonce = file + CHECKPOINT_HEADER_SIZE;
+    uint8_t *sealed = nonce + crypto_aead_xchacha20poly1305_ietf_NPUBBYTES;
+
+    memcpy(file, this->header, CHECKPOINT_HEADER_SIZE);
+    randombytes_buf(nonce, crypto_aead_xchacha20poly1305_ietf_NPUBBYTES);
+
+    storeUint32(plaintext, iteration);
+    memcpy(plaintext + 4, seed, 32);
+    crypto_aead_xchacha20poly1305_ietf_encrypt(sealed, NULL, plaintext, sizeof(plaintext),
+                                               this->header, CHECKPOINT_HEADER_SIZE, NULL, nonce, this->key);
+    sodium_memzero(plaintext, sizeof(plaintext));
+
+    // a crash at any point leaves either the previous or the new checkpoint
+    std::string tmpPath = this->path + ".tmp";
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        throw GeneratorException("Unable to write setup checkpoint " + tmpPath, GeneratorExceptionTypes::GENERATOR_SETUP_ERROR);
+
+    bool ok = write(fd, file, sizeof(file)) == (ssize_t)sizeof(file);
+    ok = fsync(fd) == 0 && ok;
+    ok = close(fd) == 0 && ok;
+
+    if (!ok || rename(tmpPath.c_str(), this->path.c_str()) != 0)
+    {
+        unlink(tmpPath.c_str());
+        throw GeneratorException("Unable to write setup checkpoint " + this->path, GeneratorExceptionTypes::GENERATOR_SETUP_ERROR);
+    }
+
+    if (!syncDirectory(this->path))
+        throw GeneratorException("Unable to sync the directory of setup checkpoint " + this->path, GeneratorExceptionTypes::GENERATOR_SETUP_ERROR);
+}
+
+void SetupCheckpoint::remove() const
+{
+    unlink(this->path.c_str());
+}
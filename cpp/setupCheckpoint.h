@@ -0,0 +1,45 @@
+#pragma once
+
+#include "generator.h"
+#include <sodium.h>
+#include <cstdint>
+#include <string>
+
+#define CHECKPOINT_MAGIC "DRSACKP1"
+#define CHECKPOINT_HEADER_SIZE 16
+#define CHECKPOINT_PLAINTEXT_SIZE (4 + 32)
+
+// Progress of Generator::setup saved to disk: the number of completed
+// pattern-search iterations and the seed they produced. Each iteration only
+// depends on the previous seed, so continuing from a checkpoint gives the
+// same generator as an uninterrupted setup.
+//
+// The file is sealed with XChaCha20-Poly1305 under a key derived from the
+// Argon2 bootstrap seed, so reading it is as hard as redoing the bootstrap,
+// and the header with IC and patternBytes is authenticated too: a file left
+// by other parameters, or modified, simply fails to load.
+//
+//   header (magic, IC, patternBytes) | nonce | sealed (iteration, seed) | tag
+class SetupCheckpoint
+{
+
+public:
+    SetupCheckpoint(const std::string &path, const GeneratorArgs &args, const uint8_t *bootstrapSeed);
+    ~SetupCheckpoint();
+
+    SetupCheckpoint(const SetupCheckpoint &) = delete;
+    SetupCheckpoint &operator=(const SetupCheckpoint &) = delete;
+
+    // Latest saved progress; false when there is none for these parameters
+    bool load(uint32_t &iteration, uint8_t *seed) const;
+
+    // Replaces the file atomically (temporary file, fsync, rename)
+    void save(uint32_t iteration, const uint8_t *seed) const;
+
+    void remove() const;
+
+protected:
+    std::string path;
+    uint8_t header[CHECKPOINT_HEADER_SIZE];
+    uint8_t key[crypto_aead_xchacha20poly1305_ietf_KEYBYTES];
+};
@@ -169,6 +169,63 @@ TEST(RBG_Determinism, EqualArguments)
     ASSERT_TRUE(s1Bytes == s2Bytes);
 }
 
+TEST(RBG_Determinism, PipelinedOutput)
+{
+    const char *osCall_1 = "./RBG PWW CS 50 --limit 600000";
+    const char *osCall_2 = "./RBG PWW CS 50 --limit 600000 --pipeline 3";
+
+    std::vector<uint8_t> s1Bytes = getStdoutBytesFromCommand(osCall_1, 600000);
+    std::vector<uint8_t> s2Bytes = getStdoutBytesFromCommand(osCall_2, 600000);
+
+    ASSERT_TRUE(s1Bytes == s2Bytes);
+}
+
+std::vector<uint8_t> decodeHex(const std::vector<uint8_t> &text)
+{
+    std::vector<uint8_t> result;
+
+    for (size_t i = 0; i + 1 < text.size(); i += 2)
+        result.push_back(std::stoi(std::string(text.begin() + i, text.begin() + i + 2), nullptr, 16));
+
+    return result;
+}
+
+std::vector<uint8_t> decodeBase64(const std::vector<uint8_t> &text, const std::string &alphabet)
+{
+    std::vector<uint8_t> result;
+    uint32_t bits = 0;
+    int bitCount = 0;
+
+    for (uint8_t character : text)
+    {
+        bits = (bits << 6) | alphabet.find(character);
+        bitCount += 6;
+
+        if (bitCount >= 8)
+        {
+            bitCount -= 8;
+            result.push_back((bits >> bitCount) & 0xff);
+        }
+    }
+
+    return result;
+}
+
+TEST(RBG_Format, EncodesRawOutput)
+{
+    const std::string letters = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+
+    // 300000 raw bytes cross a pipeline buffer, whose size is not a multiple of 3
+    std::vector<uint8_t> raw = getStdoutBytesFromCommand("./RBG PWW CS 50 --limit 300000", 300000);
+    std::vector<uint8_t> hex = getStdoutBytesFromCommand("./RBG PWW CS 50 --limit 600000 --format hex", 600000);
+    std::vector<uint8_t> base64 = getStdoutBytesFromCommand("./RBG PWW CS 50 --limit 400000 --format base64", 400000);
+    std::vector<uint8_t> base64Url = getStdoutBytesFromCommand("./RBG PWW CS 50 --limit 400000 --format base64url --pipeline 3", 400000);
+
+    ASSERT_TRUE(decodeHex(hex) == raw);
+    ASSERT_TRUE(decodeBase64(base64, letters + "+/") == raw);
+    ASSERT_TRUE(decodeBase64(base64Url, letters + "-_") == raw);
+}
+
 #ifndef GITHUB_WORKFLOW_ACTIVATED
 TEST(RBG_ExitCodes, InvalidArguments)
 {
@@ -181,6 +238,13 @@ TEST(RBG_ExitCodes, InvalidArguments)
         "./RBG PW CS 5 --limit -1",
         "./RBG PW CS 5 --limit X",
         "./RBG PW CS 5 --limit 1 2 3",
+        "./RBG PW CS 5 --pipeline",
+        "./RBG PW CS 5 --pipeline 1",
+        "./RBG PW CS 5 --format",
+        "./RBG PW CS 5 --format base32",
+        "./RBG PW CS 5 --stream-id",
+        "./RBG PW CS 5 --checkpoint",
+        "./RBG PW CS 5 --checkpoint ck --checkpoint-interval 0",
     };
 
     for (const char *command : badCommands)
@@ -1,23 +1,78 @@
 #include <gtest/gtest.h>
 #include "generator.h"
+#include "generatorBatch.h"
+#include "argon2Arena.h"
+#include "generatorSampler.h"
+#include "setupCheckpoint.h"
+#include "generatorException.h"
+#include <cstring>
+#include <openssl/kdf.h>
 
 class GeneratorTest : public Generator
 {
 public:
     using Generator::calculateSeed;
+    using Generator::findBootstrapSeed;
+    using Generator::findNextSeedByPattern;
     using Generator::generatePattern;
+    using Generator::initializeGenerator;
+    using Generator::seekNextBytesFromGenerator;
+
+    void keystreamAt(uint64_t offset, uint8_t *out, int nbytes)
+    {
+        Generator::keystreamAt(this->cipher.ctx, offset, out, nbytes);
+    }
+
+    // Keys the generator directly, skipping the expensive setup
+    void setupWithSeed(Seed seed)
+    {
+        initializeGenerator(seed);
+        setupDone = true;
+    }
     using Generator::LeadingPatternBytes;
     using Generator::Pattern;
     using Generator::Seed;
     using Generator::SHA256Result;
 
     GeneratorTest(GeneratorArgs &args) : Generator(args) {}
+    GeneratorTest(GeneratorTest &&other) = default;
+};
+
+class GeneratorBatchTest : public GeneratorBatch
+{
+public:
+    using GeneratorBatch::keystreamBlocks;
+    using GeneratorBatch::LaneKeys;
+    using GeneratorBatch::searchSeeds;
+    using GeneratorBatch::setLaneKey;
+
+    // runs the lanes even where setup() and nextBlocks() would not
+    GeneratorBatchTest(std::vector<Generator> &generators) : GeneratorBatch(generators) { this->lockstep = true; }
 };
 
+GeneratorArgs testArgs(int patternBytes)
+{
+    GeneratorArgs args;
+    args.PW = "pw";
+    args.CS = "cs";
+    args.IC = 1;
+    args.patternBytes = patternBytes;
+    return args;
+}
+
+GeneratorTest::Seed testSeed(int offset)
+{
+    GeneratorTest::Seed seed;
+    for (unsigned int i = 0; i < sizeof(seed.bytes); i++)
+        seed.bytes[i] = i * 7 + offset;
+    return seed;
+}
+
 TEST(Generator, generatePattern)
 {
 
     GeneratorTest::Pattern pattern;
+    pattern.size = PatternBytes;
     std::string confusionString = "confusion_string";
 
     GeneratorTest::generatePattern(pattern, confusionString);
@@ -59,6 +114,395 @@ TEST(Generator, calculateSeed)
         ASSERT_EQ(result.bytes[i], expectedResult.bytes[i]);
 }
 
+TEST(Generator, moveKeepsKeystream)
+{
+    GeneratorArgs args = testArgs(PatternBytes);
+    GeneratorTest::Seed seed = testSeed(0);
+    uint8_t expected[64], result[64];
+
+    GeneratorTest reference(args);
+    reference.initializeGenerator(seed);
+    reference.seekNextBytesFromGenerator(expected, sizeof(expected));
+
+    GeneratorTest first(args);
+    first.initializeGenerator(seed);
+    first.seekNextBytesFromGenerator(result, 32);
+
+    GeneratorTest second(std::move(first));
+    second.seekNextBytesFromGenerator(result + 32, 32);
+
+    ASSERT_EQ(memcmp(result, expected, sizeof(expected)), 0);
+}
+
+TEST(Generator, findNextSeedByPattern)
+{
+    GeneratorArgs args = testArgs(2);
+    GeneratorTest generator(args);
+    GeneratorTest::Pattern pattern;
+    GeneratorTest::Seed seed = testSeed(2);
+
+    // final seed of the original byte-by-byte pattern search
+    GeneratorTest::Seed expectedResult = {
+        0x66, 0x63, 0xae, 0x20, 0xca, 0x0e, 0x6a, 0xf3, 0x0d, 0xbe, 0xf4, 0x3a, 0xa9, 0x47, 0xb1, 0x2f,
+        0x2f, 0x2e, 0x90, 0x92, 0x3f, 0xd7, 0xee, 0xf9, 0x5d, 0x5e, 0x00, 0x6f, 0xbc, 0x5e, 0x82, 0xc8};
+
+    pattern.size = args.patternBytes;
+    GeneratorTest::generatePattern(pattern, args.CS);
+
+    generator.initializeGenerator(seed);
+    for (int i = 0; i < 300; i++)
+    {
+        generator.findNextSeedByPattern(pattern, seed);
+        generator.initializeGenerator(seed);
+    }
+
+    for (unsigned int i = 0; i < sizeof(GeneratorTest::Seed); i++)
+        ASSERT_EQ(seed.bytes[i], expectedResult.bytes[i]);
+}
+
+TEST(Generator, findNextSeedByPatternParallel)
+{
+    GeneratorArgs serialArgs = testArgs(3);
+    GeneratorArgs parallelArgs = testArgs(3);
+    parallelArgs.threads = 4;
+
+    GeneratorTest serial(serialArgs), parallel(parallelArgs);
+    GeneratorTest::Pattern pattern;
+    GeneratorTest::Seed serialSeed = testSeed(3), parallelSeed = testSeed(3);
+
+    pattern.size = serialArgs.patternBytes;
+    GeneratorTest::generatePattern(pattern, serialArgs.CS);
+
+    serial.initializeGenerator(serialSeed);
+    parallel.initializeGenerator(parallelSeed);
+    for (int i = 0; i < 3; i++)
+    {
+        serial.findNextSeedByPattern(pattern, serialSeed);
+        serial.initializeGenerator(serialSeed);
+        parallel.findNextSeedByPattern(pattern, parallelSeed);
+        parallel.initializeGenerator(parallelSeed);
+    }
+
+    ASSERT_EQ(memcmp(serialSeed.bytes, parallelSeed.bytes, sizeof(serialSeed.bytes)), 0);
+}
+
+class Argon2ArenaTest : public Argon2Arena
+{
+public:
+    bool isWiped() const
+    {
+        for (size_t i = 0; i < this->size; i++)
+            if (this->memory[i] != 0)
+                return false;
+        return true;
+    }
+};
+
+TEST(Generator, findBootstrapSeedWithArena)
+{
+    GeneratorArgs args = testArgs(PatternBytes);
+    GeneratorTest plain(args), withArena(args);
+    GeneratorTest::Seed expected, result;
+    std::shared_ptr<Argon2ArenaTest> arena = std::make_shared<Argon2ArenaTest>();
+
+    plain.findBootstrapSeed(args, expected);
+
+    withArena.setArgon2Arena(arena);
+    withArena.findBootstrapSeed(args, result);
+
+    ASSERT_GE(arena->capacity(), (size_t)1024 * 1024 * 1024);
+    ASSERT_EQ(memcmp(expected.bytes, result.bytes, sizeof(expected.bytes)), 0);
+
+    // the arena is reused, and wiped (by libargon2), between calls
+    ASSERT_TRUE(arena->isWiped());
+    withArena.findBootstrapSeed(args, result);
+    ASSERT_EQ(memcmp(expected.bytes, result.bytes, sizeof(expected.bytes)), 0);
+}
+
+TEST(SetupCheckpoint, saveAndLoad)
+{
+    const std::string path = testing::TempDir() + "drsa_checkpoint_save";
+    GeneratorArgs args = testArgs(3);
+    args.IC = 10;
+    GeneratorTest::Seed bootstrap = testSeed(5), seed = testSeed(6), loaded;
+    uint32_t iteration = 0;
+
+    SetupCheckpoint checkpoint(path, args, bootstrap.bytes);
+    checkpoint.remove();
+    ASSERT_FALSE(checkpoint.load(iteration, loaded.bytes));
+
+    checkpoint.save(4, seed.bytes);
+    ASSERT_TRUE(checkpoint.load(iteration, loaded.bytes));
+    ASSERT_EQ(iteration, 4u);
+    ASSERT_EQ(memcmp(loaded.bytes, seed.bytes, sizeof(seed.bytes)), 0);
+
+    // other parameters, or another password (bootstrap seed), cannot use it
+    GeneratorArgs other = args;
+    other.patternBytes = 2;
+    ASSERT_FALSE(SetupCheckpoint(path, other, bootstrap.bytes).load(iteration, loaded.bytes));
+    ASSERT_FALSE(SetupCheckpoint(path, args, testSeed(7).bytes).load(iteration, loaded.bytes));
+
+    // nor can a modified file
+    uint8_t file[128];
+    FILE *fp = fopen(path.c_str(), "r+b");
+    ASSERT_NE(fp, nullptr);
+    size_t length = fread(file, 1, sizeof(file), fp);
+    file[length - 20] ^= 1;
+    rewind(fp);
+    fwrite(file, 1, length, fp);
+    fclose(fp);
+    ASSERT_FALSE(checkpoint.load(iteration, loaded.bytes));
+
+    checkpoint.remove();
+}
+
+TEST(Generator, setupResumesFromCheckpoint)
+{
+    const std::string path = testing::TempDir() + "drsa_checkpoint_resume";
+    GeneratorArgs args = testArgs(PatternBytes);
+    args.IC = 6;
+    GeneratorTest generator(args), reference(args);
+    GeneratorTest::Seed bootstrap, seed = testSeed(8);
+    GeneratorTest::Pattern pattern;
+    pattern.size = PatternBytes;
+
+    generator.findBootstrapSeed(args, bootstrap);
+
+    // as if an earlier run had been stopped after 4 iterations at this seed,
+    // so setup only runs the last 2 from it
+    SetupCheckpoint(path, args, bootstrap.bytes).save(4, seed.bytes);
+
+    GeneratorTest::generatePattern(pattern, args.CS);
+    reference.initializeGenerator(seed);
+    for (int i = 4; i < args.IC; i++)
+    {
+        reference.findNextSeedByPattern(pattern, seed);
+        reference.initializeGenerator(seed);
+    }
+    reference.setupWithSeed(seed);
+
+    generator.setCheckpointFile(path);
+    generator.setup();
+
+    uint8_t expected[1024], result[1024];
+    reference.nextBlock(expected, sizeof(expected));
+    generator.nextBlock(result, sizeof(result));
+    ASSERT_EQ(memcmp(expected, result, sizeof(expected)), 0);
+
+    // a completed setup leaves no checkpoint behind
+    ASSERT_EQ(fopen(path.c_str(), "rb"), nullptr);
+}
+
+TEST(GeneratorBatch, keystreamMatchesOpenSSL)
+{
+    GeneratorBatchTest::LaneKeys keys = {};
+    int lanes = GeneratorBatch::lanes();
+    const int blocks = 3;
+    std::vector<uint8_t> keystream(lanes * blocks * 64);
+
+    for (int l = 0; l < lanes; l++)
+    {
+        // counters around the 32-bit carry into the nonce word
+        uint64_t counter = l % 2 == 0 ? l * 1000 : 0xFFFFFFFFull - l / 2;
+        GeneratorBatchTest::setLaneKey(keys, l, testSeed(l), counter);
+    }
+
+    GeneratorBatchTest::keystreamBlocks(keys, keystream.data(), blocks);
+
+    for (int l = 0; l < lanes; l++)
+    {
+        GeneratorArgs args = testArgs(PatternBytes);
+        GeneratorTest generator(args);
+        GeneratorTest::Seed seed = testSeed(l);
+        uint8_t expected[blocks * 64];
+
+        generator.initializeGenerator(seed);
+        generator.keystreamAt(keys.counters[l] * 64, expected, sizeof(expected));
+
+        ASSERT_EQ(memcmp(keystream.data() + l * blocks * 64, expected, sizeof(expected)), 0) << "lane " << l;
+    }
+}
+
+TEST(GeneratorBatch, matchesIndividualGenerators)
+{
+    // more generators than lanes, with different iteration counts and patterns
+    const int count = GeneratorBatch::lanes() + 3;
+    std::vector<Generator> generators;
+    std::vector<GeneratorTest::Seed> seeds;
+    std::vector<std::vector<uint8_t>> expected;
+    const int reads[] = {100, 37, 5000};
+
+    for (int i = 0; i < count; i++)
+    {
+        GeneratorArgs args = testArgs(1 + i % 2);
+        args.CS = "cs" + std::to_string(i);
+        args.IC = 1 + (i * 7) % 13;
+
+        GeneratorTest reference(args);
+        GeneratorTest::Seed seed = testSeed(i);
+        reference.initializeGenerator(seed);
+        for (int j = 0; j < args.IC; j++)
+        {
+            GeneratorTest::Pattern pattern;
+            pattern.size = args.patternBytes;
+            GeneratorTest::generatePattern(pattern, args.CS);
+            reference.findNextSeedByPattern(pattern, seed);
+            reference.initializeGenerator(seed);
+        }
+
+        std::vector<uint8_t> bytes(100 + 37 + 5000);
+        reference.seekNextBytesFromGenerator(bytes.data(), 100);
+        reference.seekNextBytesFromGenerator(bytes.data() + 100, 37);
+        reference.seekNextBytesFromGenerator(bytes.data() + 137, 5000);
+        expected.push_back(bytes);
+
+        generators.emplace_back(args);
+        seeds.push_back(testSeed(i));
+    }
+
+    GeneratorBatchTest batch(generators);
+    batch.searchSeeds(seeds);
+
+    std::vector<std::vector<uint8_t>> results(count, std::vector<uint8_t>(100 + 37 + 5000));
+    int offset = 0;
+    for (int length : reads)
+    {
+        std::vector<uint8_t *> blocks;
+        for (auto &result : results)
+            blocks.push_back(result.data() + offset);
+
+        batch.nextBlocks(blocks.data(), length);
+        offset += length;
+    }
+
+    for (int i = 0; i < count; i++)
+        ASSERT_TRUE(results[i] == expected[i]) << "generator " << i;
+}
+
+TEST(GeneratorBatch, rejectsCheckpointFile)
+{
+    std::vector<Generator> generators;
+    generators.emplace_back(testArgs(PatternBytes));
+    generators.emplace_back(testArgs(PatternBytes));
+    generators[1].setCheckpointFile(testing::TempDir() + "drsa_checkpoint_batch");
+
+    GeneratorBatch batch(generators);
+    ASSERT_THROW(batch.setup(), GeneratorException);
+}
+
+TEST(Generator, substream)
+{
+    GeneratorArgs args = testArgs(PatternBytes);
+    GeneratorTest generator(args), reference(args);
+    generator.setupWithSeed(testSeed(4));
+
+    // the child key is plain HKDF-SHA256 over the final setup seed
+    GeneratorTest::Seed parentKey = testSeed(4), expectedKey;
+    const std::string label = "worker-7";
+    size_t keyLength = sizeof(expectedKey.bytes);
+    EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    ASSERT_EQ(EVP_PKEY_derive_init(pctx), 1);
+    ASSERT_EQ(EVP_PKEY_CTX_set_hkdf_md(pctx, EVP_sha256()), 1);
+    ASSERT_EQ(EVP_PKEY_CTX_set1_hkdf_salt(pctx, (const unsigned char *)SUBSTREAM_HKDF_SALT, strlen(SUBSTREAM_HKDF_SALT)), 1);
+    ASSERT_EQ(EVP_PKEY_CTX_set1_hkdf_key(pctx, parentKey.bytes, sizeof(parentKey.bytes)), 1);
+    ASSERT_EQ(EVP_PKEY_CTX_add1_hkdf_info(pctx, (const unsigned char *)label.data(), label.size()), 1);
+    ASSERT_EQ(EVP_PKEY_derive(pctx, expectedKey.bytes, &keyLength), 1);
+    EVP_PKEY_CTX_free(pctx);
+    reference.setupWithSeed(expectedKey);
+
+    // reading the parent first must not change its children
+    uint8_t parentBytes[4096], childBytes[4096], siblingBytes[4096], expected[4096];
+    generator.nextBlock(parentBytes, sizeof(parentBytes));
+
+    Generator child = generator.substream(label);
+    Generator sibling = generator.substream("worker-8");
+    child.nextBlock(childBytes, sizeof(childBytes));
+    sibling.nextBlock(siblingBytes, sizeof(siblingBytes));
+    reference.nextBlock(expected, sizeof(expected));
+
+    ASSERT_EQ(memcmp(childBytes, expected, sizeof(expected)), 0);
+    ASSERT_NE(memcmp(childBytes, siblingBytes, sizeof(childBytes)), 0);
+    ASSERT_NE(memcmp(childBytes, parentBytes, sizeof(childBytes)), 0);
+
+    GeneratorTest unset(args);
+    ASSERT_THROW(unset.substream(label), std::exception);
+}
+
+TEST(GeneratorSampler, wordsAreLittleEndianKeystream)
+{
+    GeneratorArgs args = testArgs(PatternBytes);
+    GeneratorTest generator(args), reference(args);
+    generator.setupWithSeed(testSeed(1));
+    reference.setupWithSeed(testSeed(1));
+
+    // odd counts make words straddle the sampler's buffer refills
+    std::vector<uint32_t> words32(5001);
+    std::vector<uint64_t> words64(3001);
+    GeneratorSampler sampler(generator);
+    sampler.fillUint32(words32.data(), words32.size());
+    sampler.fillUint64(words64.data(), words64.size());
+
+    std::vector<uint8_t> keystream(words32.size() * 4 + words64.size() * 8);
+    reference.nextBlock(keystream.data(), keystream.size());
+
+    ASSERT_EQ(memcmp(words32.data(), keystream.data(), words32.size() * 4), 0);
+    ASSERT_EQ(memcmp(words64.data(), keystream.data() + words32.size() * 4, words64.size() * 8), 0);
+}
+
+TEST(GeneratorSampler, uniformMatchesSequentialLemire)
+{
+    GeneratorArgs args = testArgs(PatternBytes);
+    GeneratorTest generator(args), reference(args);
+    generator.setupWithSeed(testSeed(2));
+    reference.setupWithSeed(testSeed(2));
+
+    // a range just above 2^31 rejects almost half of the candidates
+    const uint32_t range = 0x80000001u;
+    std::vector<uint32_t> samples(10000);
+    GeneratorSampler sampler(generator);
+    sampler.fillUniform32(samples.data(), samples.size(), range);
+
+    const uint32_t threshold = (uint32_t)(-range) % range;
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        uint64_t product;
+        do
+        {
+            uint32_t x;
+            reference.nextBlock((uint8_t *)&x, sizeof(x));
+            product = (uint64_t)x * range;
+        } while ((uint32_t)product < threshold);
+
+        ASSERT_EQ(samples[i], (uint32_t)(product >> 32)) << "sample " << i;
+    }
+}
+
+TEST(GeneratorSampler, rangesAndUnitIntervals)
+{
+    GeneratorArgs args = testArgs(PatternBytes);
+    GeneratorTest generator(args);
+    generator.setupWithSeed(testSeed(3));
+    GeneratorSampler sampler(generator);
+
+    std::vector<uint64_t> dice(6000);
+    sampler.fillUniform64(dice.data(), dice.size(), 6);
+    for (uint64_t value : dice)
+        ASSERT_LT(value, 6u);
+
+    std::vector<double> doubles(1000);
+    sampler.fillUnitDouble(doubles.data(), doubles.size());
+    for (double value : doubles)
+        ASSERT_TRUE(value >= 0.0 && value < 1.0);
+
+    std::vector<float> floats(1000);
+    sampler.fillUnitFloat(floats.data(), floats.size());
+    for (float value : floats)
+        ASSERT_TRUE(value >= 0.0f && value < 1.0f);
+
+    uint32_t out;
+    ASSERT_THROW(sampler.fillUniform32(&out, 1, 0), std::exception);
+}
+
 int main(int argc, char **argv)
 {
     ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,221 @@
+#include <gtest/gtest.h>
+#include <openssl/provider.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#include "generator.h"
+#include <thread>
+
+// Loads ./drsaprov.so into a fresh library context, with DRSA as its DRBG
+class DrsaLibContext
+{
+public:
+    DrsaLibContext()
+    {
+        libctx = OSSL_LIB_CTX_new();
+        OSSL_PROVIDER_set_default_search_path(libctx, ".");
+        drsa = OSSL_PROVIDER_load(libctx, "drsaprov");
+        base = OSSL_PROVIDER_load(libctx, "default");
+    }
+
+    ~DrsaLibContext()
+    {
+        OSSL_PROVIDER_unload(base);
+        OSSL_PROVIDER_unload(drsa);
+        OSSL_LIB_CTX_free(libctx);
+    }
+
+    OSSL_LIB_CTX *libctx;
+    OSSL_PROVIDER *drsa;
+    OSSL_PROVIDER *base;
+};
+
+void setGeneratorParams(EVP_RAND_CTX *ctx, const char *PW, const char *CS, int IC)
+{
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string("PW", (char *)PW, 0),
+        OSSL_PARAM_construct_utf8_string("CS", (char *)CS, 0),
+        OSSL_PARAM_construct_int("IC", &IC),
+        OSSL_PARAM_construct_end()};
+
+    ASSERT_EQ(EVP_RAND_CTX_set_params(ctx, params), 1);
+}
+
+TEST(Provider, MatchesGenerator)
+{
+    DrsaLibContext context;
+    ASSERT_NE(context.drsa, nullptr);
+
+    EVP_RAND *rand = EVP_RAND_fetch(context.libctx, "DRSA", NULL);
+    ASSERT_NE(rand, nullptr);
+
+    EVP_RAND_CTX *ctx = EVP_RAND_CTX_new(rand, NULL);
+    setGeneratorParams(ctx, "PW", "CS", 5);
+
+    char streamId[] = "stream";
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string("streamId", streamId, 0),
+        OSSL_PARAM_construct_end()};
+    ASSERT_EQ(EVP_RAND_CTX_set_params(ctx, params), 1);
+    ASSERT_EQ(EVP_RAND_instantiate(ctx, 256, 0, NULL, 0, NULL), 1);
+
+    // requests larger than max_request are split by libcrypto
+    std::vector<uint8_t> fromProvider(100000);
+    ASSERT_EQ(EVP_RAND_generate(ctx, fromProvider.data(), fromProvider.size(), 256, 0, NULL, 0), 1);
+
+    GeneratorArgs args = {"PW", "CS", 5, PatternBytes};
+    Generator root(args);
+    root.setup();
+    Generator generator = root.substream("stream");
+
+    std::vector<uint8_t> fromGenerator(fromProvider.size());
+    for (size_t offset = 0; offset < fromGenerator.size(); offset += 1024)
+        generator.nextBlock(fromGenerator.data() + offset, std::min((size_t)1024, fromGenerator.size() - offset));
+
+    ASSERT_TRUE(fromProvider == fromGenerator);
+
+    // the instance's generator and parameters are gone once uninstantiated
+    ASSERT_EQ(EVP_RAND_verify_zeroization(ctx), 0);
+    ASSERT_EQ(EVP_RAND_uninstantiate(ctx), 1);
+    ASSERT_EQ(EVP_RAND_verify_zeroization(ctx), 1);
+
+    EVP_RAND_CTX_free(ctx);
+    EVP_RAND_free(rand);
+}
+
+TEST(Provider, UnconfiguredGenerateFails)
+{
+    DrsaLibContext context;
+
+    EVP_RAND *rand = EVP_RAND_fetch(context.libctx, "DRSA", NULL);
+    EVP_RAND_CTX *ctx = EVP_RAND_CTX_new(rand, NULL);
+    uint8_t out[16];
+
+    ASSERT_EQ(EVP_RAND_instantiate(ctx, 256, 0, NULL, 0, NULL), 1);
+    ASSERT_EQ(EVP_RAND_generate(ctx, out, sizeof(out), 256, 0, NULL, 0), 0);
+
+    EVP_RAND_CTX_free(ctx);
+    EVP_RAND_free(rand);
+}
+
+TEST(Provider, UnlabelledInstanceFails)
+{
+    DrsaLibContext context;
+
+    // neither a streamId nor one of the library's DRBGs
+    EVP_RAND *rand = EVP_RAND_fetch(context.libctx, "DRSA", NULL);
+    EVP_RAND_CTX *ctx = EVP_RAND_CTX_new(rand, NULL);
+    setGeneratorParams(ctx, "PW", "CS", 5);
+    uint8_t out[16];
+
+    ASSERT_EQ(EVP_RAND_instantiate(ctx, 256, 0, NULL, 0, NULL), 1);
+    ASSERT_EQ(EVP_RAND_generate(ctx, out, sizeof(out), 256, 0, NULL, 0), 0);
+
+    EVP_RAND_CTX_free(ctx);
+    EVP_RAND_free(rand);
+}
+
+// Public and private output of a fresh library context, drawn in the given
+// order
+void drawRoleStreams(bool privateFirst, std::vector<uint8_t> &fromPublic, std::vector<uint8_t> &fromPrivate)
+{
+    DrsaLibContext context;
+    ASSERT_EQ(RAND_set_DRBG_type(context.libctx, "DRSA", NULL, NULL, NULL), 1);
+
+    fromPublic.resize(1024);
+    fromPrivate.resize(1024);
+
+    if (privateFirst)
+    {
+        setGeneratorParams(RAND_get0_private(context.libctx), "PW", "CS", 5);
+        ASSERT_EQ(RAND_priv_bytes_ex(context.libctx, fromPrivate.data(), fromPrivate.size(), 0), 1);
+        setGeneratorParams(RAND_get0_public(context.libctx), "PW", "CS", 5);
+        ASSERT_EQ(RAND_bytes_ex(context.libctx, fromPublic.data(), fromPublic.size(), 0), 1);
+    }
+    else
+    {
+        setGeneratorParams(RAND_get0_public(context.libctx), "PW", "CS", 5);
+        ASSERT_EQ(RAND_bytes_ex(context.libctx, fromPublic.data(), fromPublic.size(), 0), 1);
+        setGeneratorParams(RAND_get0_private(context.libctx), "PW", "CS", 5);
+        ASSERT_EQ(RAND_priv_bytes_ex(context.libctx, fromPrivate.data(), fromPrivate.size(), 0), 1);
+    }
+}
+
+TEST(Provider, RoleStreamsIgnoreOrder)
+{
+    std::vector<uint8_t> publicFirst, privateAfter, publicAfter, privateFirst;
+
+    drawRoleStreams(false, publicFirst, privateAfter);
+    std::thread other([&]() { drawRoleStreams(true, publicAfter, privateFirst); });
+    other.join();
+
+    ASSERT_TRUE(publicFirst == publicAfter);
+    ASSERT_TRUE(privateFirst == privateAfter);
+
+    // the labels are the roles
+    GeneratorArgs args = {"PW", "CS", 5, PatternBytes};
+    Generator root(args);
+    root.setup();
+    std::vector<uint8_t> expected(publicFirst.size());
+
+    root.substream("public").nextBlock(expected.data(), expected.size());
+    ASSERT_TRUE(publicFirst == expected);
+    root.substream("private").nextBlock(expected.data(), expected.size());
+    ASSERT_TRUE(privateFirst == expected);
+}
+
+std::string generateRSAKey()
+{
+    DrsaLibContext context;
+
+    if (RAND_set_DRBG_type(context.libctx, "DRSA", NULL, NULL, NULL) != 1)
+        return "";
+
+    setGeneratorParams(RAND_get0_private(context.libctx), "PW", "CS", 5);
+    setGeneratorParams(RAND_get0_public(context.libctx), "PW", "CS", 5);
+
+    EVP_PKEY *key = EVP_PKEY_Q_keygen(context.libctx, NULL, "RSA", (size_t)1024);
+    if (key == NULL)
+        return "";
+
+    BIGNUM *n = NULL;
+    EVP_PKEY_get_bn_param(key, OSSL_PKEY_PARAM_RSA_N, &n);
+    char *hex = BN_bn2hex(n);
+    std::string result = hex;
+
+    OPENSSL_free(hex);
+    BN_free(n);
+    EVP_PKEY_free(key);
+    return result;
+}
+
+TEST(Provider, PublicAndPrivateStreamsDiffer)
+{
+    DrsaLibContext context;
+    ASSERT_EQ(RAND_set_DRBG_type(context.libctx, "DRSA", NULL, NULL, NULL), 1);
+
+    setGeneratorParams(RAND_get0_private(context.libctx), "PW", "CS", 5);
+    setGeneratorParams(RAND_get0_public(context.libctx), "PW", "CS", 5);
+
+    std::vector<uint8_t> fromPublic(1024), fromPrivate(1024);
+    ASSERT_EQ(RAND_bytes_ex(context.libctx, fromPublic.data(), fromPublic.size(), 0), 1);
+    ASSERT_EQ(RAND_priv_bytes_ex(context.libctx, fromPrivate.data(), fromPrivate.size(), 0), 1);
+
+    ASSERT_FALSE(fromPublic == fromPrivate);
+}
+
+TEST(Provider, DeterministicRSAKeyGeneration)
+{
+    std::string n1 = generateRSAKey();
+    std::string n2 = generateRSAKey();
+
+    ASSERT_FALSE(n1.empty());
+    ASSERT_EQ(n1, n2);
+}
+
+int main(int argc, char **argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
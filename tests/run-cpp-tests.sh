@@ -2,4 +2,5 @@ cd ../cpp
 make
 
 ./test_RBG
-./test_generator
\ No newline at end of file
+./test_generator
+./test_provider